@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2012 Joshua Sandbrook.  All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * flow mode (-F). on top of the per host totals, traffic is accounted
+ * per 5-tuple, seen from the targeted host's side (local ip/port vs
+ * remote ip/port). the table is a fixed size open-addressed array of 40
+ * byte slots with linear probing, so the per packet cost is one hash and
+ * usually one or two cache lines. the counters are 64 bit, as a single
+ * exported flow record can be well over 4GB. every TOM_LOGTIME seconds
+ * the flows are written out to:
+ *
+ *   log_dir/flows/<ip>           <epoch> <proto> <lport> <remote> <rport> <tx> <rx>
+ *   log_dir/services/<proto>.<port>  <epoch> <tx> <rx>
+ *
+ * (under log_dir/<partition>/ when the logs are partitioned, like the
+ * host logs).
+ *
+ * where the service port of a tcp/udp flow is the lower of its two
+ * ports. flows idle for TOM_FLOWTIME are dropped from the table.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "tom.h"
+#include "string.h"
+
+#define FLOW_MASK    (TOM_FLOW_SLOTS - 1)
+#define FLOW_MAX     (TOM_FLOW_SLOTS / 4 * 3)  /* max load, 75% */
+
+struct flow_key {
+    uint32_t local;         /* targeted host, network order */
+    uint32_t remote;
+    uint16_t lport;
+    uint16_t rport;
+    uint8_t  proto;
+    uint8_t  pad[3];        /* always zero, so keys compare with memcmp */
+};
+
+struct flow {
+    uint32_t        hash;   /* precomputed hash of key, 0 if slot is free */
+    struct flow_key key;
+    uint32_t        last_traffic;
+    uint64_t        tx;
+    uint64_t        rx;
+};
+
+/* tx/rx per service port, from the targeted hosts point of view */
+struct service {
+    uint64_t tx;
+    uint64_t rx;
+};
+
+struct flow_table {
+    struct flow    *slots;          /* TOM_FLOW_SLOTS of them */
+    uint32_t        used;
+    uint32_t        dropped;        /* new flows refused as the table was full */
+    uint32_t        last_logged;
+    struct flow   **pending;        /* scratch list used while logging */
+    struct service *services[2];    /* tcp, udp; indexed by port */
+};
+
+/* hash of the key. never returns 0, as that marks a free slot */
+static uint32_t
+flow_hash(const struct flow_key *k)
+{
+    uint32_t h = tom_hash16(k);
+
+    return h ? h : 1;
+}
+
+/* set up the flow table. only called when flow mode is on */
+int
+flow_init(struct tom *tomi)
+{
+    struct flow_table *ft;
+
+    ft = calloc(1, sizeof(struct flow_table));
+    if (!ft)
+        err(1, NULL);
+
+    ft->slots = calloc(TOM_FLOW_SLOTS, sizeof(struct flow));
+    ft->pending = calloc(FLOW_MAX, sizeof(struct flow *));
+    ft->services[0] = calloc(65536, sizeof(struct service));
+    ft->services[1] = calloc(65536, sizeof(struct service));
+    if (!ft->slots || !ft->pending || !ft->services[0] || !ft->services[1])
+        err(1, NULL);
+
+    tomi->flows = ft;
+    return TOM_OK;
+}
+
+/* free the flow table, doesnt log anything */
+void
+flow_free(struct tom *tomi)
+{
+    struct flow_table *ft = tomi->flows;
+
+    if (!ft)
+        return;
+    free(ft->slots);
+    free(ft->pending);
+    free(ft->services[0]);
+    free(ft->services[1]);
+    free(ft);
+    tomi->flows = NULL;
+}
+
+/*
+ * account a packet against the flow it belongs to. tx says weather the
+ * targeted end of the pair (already matched by host_account()) was the
+ * source or the dst.
+ */
+int
+flow_account(struct tom *tomi,
+             struct pcap_pkthdr *header,
+             struct ip_pair *pair,
+             uint64_t bytes,
+             int tx)
+{
+    struct flow_table *ft = tomi->flows;
+    struct flow_key key;
+    struct flow *f;
+    uint32_t hash;
+    uint32_t x;
+
+    if (pair->src.type != TOM_IP4)
+        return TOM_SKIPPED;
+
+    memset(&key, 0, sizeof(key));
+    key.proto = pair->proto;
+    if (tx) {
+        memcpy(&key.local, pair->src.addr, 4);
+        memcpy(&key.remote, pair->dst.addr, 4);
+        key.lport = pair->sport;
+        key.rport = pair->dport;
+    }
+    else {
+        memcpy(&key.local, pair->dst.addr, 4);
+        memcpy(&key.remote, pair->src.addr, 4);
+        key.lport = pair->dport;
+        key.rport = pair->sport;
+    }
+    hash = flow_hash(&key);
+
+    /* linear probe till we find the flow or a free slot */
+    for (x = hash & FLOW_MASK; ; x = (x + 1) & FLOW_MASK) {
+        f = &ft->slots[x];
+        if (!f->hash)
+            break;
+        if (f->hash == hash && !memcmp(&f->key, &key, sizeof(key)))
+            goto found;
+    }
+
+    if (ft->used >= FLOW_MAX) {
+        ft->dropped++;
+        return TOM_SKIPPED;
+    }
+    f->hash = hash;
+    f->key = key;
+    f->tx = 0;
+    f->rx = 0;
+    ft->used++;
+
+found:
+    f->last_traffic = header->ts.tv_sec;
+    if (tx)
+        f->tx += bytes;
+    else
+        f->rx += bytes;
+
+    return TOM_OK;
+}
+
+/* remove the flow in slot x, shifting back any entries that probed past it */
+static void
+flow_delete(struct flow_table *ft, uint32_t x)
+{
+    uint32_t y;
+    uint32_t home;
+
+    for (y = (x + 1) & FLOW_MASK; ft->slots[y].hash; y = (y + 1) & FLOW_MASK) {
+        home = ft->slots[y].hash & FLOW_MASK;
+        /* can slot y's entry legally live in the hole at x? */
+        if (((y - home) & FLOW_MASK) >= ((y - x) & FLOW_MASK)) {
+            ft->slots[x] = ft->slots[y];
+            x = y;
+        }
+    }
+    ft->slots[x].hash = 0;
+    ft->used--;
+}
+
+/* sort pending flows by local ip so each host's file is opened once */
+static int
+flow_cmp(const void *a, const void *b)
+{
+    const struct flow *fa = *(const struct flow **)a;
+    const struct flow *fb = *(const struct flow **)b;
+
+    return memcmp(&fa->key.local, &fb->key.local, 4);
+}
+
+/* write out the per host flow records for the pending flows */
+static void
+flow_log_hosts(struct tom *tomi, uint32_t count)
+{
+    struct flow_table *ft = tomi->flows;
+    struct flow *f;
+    struct ip_addr ip;
+    char path[256];
+    char sub[32];
+    char name[64];
+    char remote[64];
+    FILE *fh = NULL;
+    uint32_t x;
+
+    memset(&ip, 0, sizeof(ip));
+    ip.type = TOM_IP4;
+    ip.mask = 32;
+
+    for (x=0; x<count; x++) {
+        f = ft->pending[x];
+
+        /* next host? */
+        if (x == 0 || f->key.local != ft->pending[x - 1]->key.local) {
+            if (fh)
+                fclose(fh);
+            memcpy(ip.addr, &f->key.local, 4);
+            ip_str(&ip, name, sizeof(name));
+            fh = NULL;
+            if (tom_log_path(tomi, tom_log_sub(tomi, "flows", sub, sizeof(sub)),
+                             name, path, sizeof(path)) == TOM_OK) {
+                fh = fopen(path, "a");
+                if (!fh)
+                    syslog(LOG_ERR, "Could not open %s for writing", path);
+            }
+        }
+        if (!fh)
+            continue;
+
+        memcpy(ip.addr, &f->key.remote, 4);
+        ip_str(&ip, remote, sizeof(remote));
+        /* output is: <epoch> <proto> <lport> <remote> <rport> <tx> <rx>\n */
+        fprintf(fh, "%u %u %u %s %u %llu %llu\n", ft->last_logged,
+                f->key.proto, f->key.lport, remote, f->key.rport,
+                (unsigned long long)f->tx, (unsigned long long)f->rx);
+    }
+    if (fh)
+        fclose(fh);
+}
+
+/* write out and reset the per service totals */
+static void
+flow_log_services(struct tom *tomi)
+{
+    struct flow_table *ft = tomi->flows;
+    struct service *s;
+    char path[256];
+    char sub[32];
+    char name[16];
+    FILE *fh;
+    int p;
+    int port;
+
+    for (p=0; p<2; p++) {
+        for (port=0; port<65536; port++) {
+            s = &ft->services[p][port];
+            if (!s->tx && !s->rx)
+                continue;
+
+            snprintf(name, sizeof(name), "%s.%u", p ? "udp" : "tcp", port);
+            if (tom_log_path(tomi, tom_log_sub(tomi, "services", sub, sizeof(sub)),
+                             name, path, sizeof(path)) != TOM_OK)
+                continue;
+            fh = fopen(path, "a");
+            if (!fh) {
+                syslog(LOG_ERR, "Could not open %s for writing", path);
+                continue;
+            }
+            /* same format as the host logs */
+            fprintf(fh, "%u %llu %llu\n", ft->last_logged,
+                    (unsigned long long)s->tx, (unsigned long long)s->rx);
+            fclose(fh);
+            s->tx = 0;
+            s->rx = 0;
+        }
+    }
+}
+
+/*
+ * log every flow with pending traffic once per TOM_LOGTIME, then expire
+ * idle flows. if flush is set, log straight away, ie when shutting down.
+ */
+int
+flow_housekeep(struct tom *tomi, int flush)
+{
+    struct flow_table *ft = tomi->flows;
+    struct flow *f;
+    struct service *s;
+    struct timeval now;
+    char sub[32];
+    uint32_t count;
+    uint32_t port;
+    uint32_t x;
+
+    if (!ft)
+        return TOM_OK;
+
+    gettimeofday(&now, NULL);
+    if (!ft->last_logged)
+        ft->last_logged = now.tv_sec;
+    if (!flush && now.tv_sec - ft->last_logged <= TOM_LOGTIME)
+        return TOM_OK;
+
+    /* gather up everything with traffic since last time */
+    count = 0;
+    for (x=0; x<TOM_FLOW_SLOTS; x++) {
+        f = &ft->slots[x];
+        if (f->hash && (f->tx || f->rx))
+            ft->pending[count++] = f;
+    }
+
+    if (count) {
+        if (tom_log_mkdir(tomi, tom_log_sub(tomi, "flows", sub,
+                                            sizeof(sub))) != TOM_OK ||
+            tom_log_mkdir(tomi, tom_log_sub(tomi, "services", sub,
+                                            sizeof(sub))) != TOM_OK)
+            return TOM_FAIL;
+
+        qsort(ft->pending, count, sizeof(struct flow *), flow_cmp);
+        flow_log_hosts(tomi, count);
+
+        for (x=0; x<count; x++) {
+            f = ft->pending[x];
+            if (f->key.proto == IPPROTO_TCP || f->key.proto == IPPROTO_UDP) {
+                port = f->key.lport < f->key.rport ? f->key.lport : f->key.rport;
+                s = &ft->services[f->key.proto == IPPROTO_UDP][port];
+                s->tx += f->tx;
+                s->rx += f->rx;
+            }
+            f->tx = 0;
+            f->rx = 0;
+        }
+        flow_log_services(tomi);
+    }
+
+    /* drop idle flows. dont advance after a delete, as an entry moves in */
+    for (x=0; x<TOM_FLOW_SLOTS; ) {
+        f = &ft->slots[x];
+        if (f->hash && now.tv_sec - f->last_traffic > TOM_FLOWTIME)
+            flow_delete(ft, x);
+        else
+            x++;
+    }
+
+    if (ft->dropped) {
+        syslog(LOG_WARNING, "flow table full, %u new flows not tracked",
+               ft->dropped);
+        ft->dropped = 0;
+    }
+
+    ft->last_logged = now.tv_sec;
+    return TOM_OK;
+}
@@ -0,0 +1,55 @@
+#!/usr/bin/perl
+# stand in for a router exporting flows, for poking at TOM's -n collector.
+# sends one flow record of the given size between src and dst, as
+# NetFlow v5, v9 or IPFIX (v9 and IPFIX send their template first).
+#
+# eg: flow_export.pl 127.0.0.1 2055 v9 192.168.0.5 8.8.8.8 1500
+use strict;
+use Socket;
+
+my $argc = $#ARGV + 1;
+if ($argc < 6) {
+    print "usage: flow_export.pl host port v5|v9|ipfix src dst bytes [count]\n";
+    exit;
+}
+my ($host, $port, $version, $src, $dst, $bytes, $count) = @ARGV;
+$count = 1 unless $count;
+
+socket(SOCK, PF_INET, SOCK_DGRAM, getprotobyname('udp')) or die "socket: $!";
+my $to = sockaddr_in($port, inet_aton($host)) or die "bad host $host";
+
+my $srcn = inet_aton($src) or die "bad src $src";
+my $dstn = inet_aton($dst) or die "bad dst $dst";
+my $now = time();
+my $seq = 0;
+
+# template 256: src addr, dst addr, bytes, proto, src port, dst port
+my @fields = ([8, 4], [12, 4], [1, 4], [4, 1], [7, 2], [11, 2]);
+my $tmpl = pack("nn", 256, scalar(@fields)) . join('', map { pack("nn", @$_) } @fields);
+my $rec = $srcn . $dstn . pack("NCnn", $bytes, 6, 40000, 80);
+
+for (my $x = 0; $x < $count; $x++) {
+    my $pkt;
+    if ($version eq 'v5') {
+        $pkt = pack("nnNNNNCCn", 5, 1, 0, $now, 0, $seq++, 0, 0, 0)
+            . $srcn . $dstn . pack("N", 0)          # nexthop
+            . pack("nnNNNN", 0, 0, 1, $bytes, 0, 0) # ifaces, pkts, octets, first, last
+            . pack("nnCCCCnnCCn", 40000, 80, 0, 0, 6, 0, 0, 0, 0, 0, 0);
+    }
+    elsif ($version eq 'v9') {
+        my $tset = pack("nn", 0, 4 + length($tmpl)) . $tmpl;
+        my $data = $rec . "\0" x ((4 - length($rec) % 4) % 4);
+        my $dset = pack("nn", 256, 4 + length($data)) . $data;
+        $pkt = pack("nnNNNN", 9, 2, 0, $now, $seq++, 0) . $tset . $dset;
+    }
+    elsif ($version eq 'ipfix') {
+        my $tset = pack("nn", 2, 4 + length($tmpl)) . $tmpl;
+        my $dset = pack("nn", 256, 4 + length($rec)) . $rec;
+        my $body = $tset . $dset;
+        $pkt = pack("nnNNN", 10, 16 + length($body), $now, $seq++, 0) . $body;
+    }
+    else {
+        die "unknown version $version, use v5, v9 or ipfix";
+    }
+    send(SOCK, $pkt, 0, $to) or die "send: $!";
+}
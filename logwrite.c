@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2012 Joshua Sandbrook.  All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * batched host log writes using io_uring. each host due for logging
+ * becomes a linked open -> write -> close chain, using a registered file
+ * slot instead of a real fd, and the whole lot goes to the kernel in one
+ * io_uring_enter(). completions are picked up on the next pass without
+ * waiting for them. the ring is driven with the raw syscalls so there is
+ * no extra library to link. if the kernel (or the headers we were built
+ * against) cant do it, logw_init() fails and host_log() is used instead.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "tom.h"
+#include "string.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define LOGW_SQES   (TOM_LOGW_SLOTS * 4)    /* 3 per write, rounded up */
+
+enum { LOGW_OPEN = 0, LOGW_WRITE, LOGW_CLOSE };
+
+/* one queued host log write */
+struct logw_entry {
+    char         path[256];
+    char         data[TOM_LOG_RECORD];
+    uint32_t     len;
+    struct host *host;      /* marked as logging till we are done */
+    uint64_t     tx;        /* what was taken off the host, put back on error */
+    uint64_t     rx;
+    int          pending;   /* cqes still to come */
+};
+
+struct logw {
+    int                  fd;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    struct io_uring_sqe *sqes;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;
+    size_t               sq_size;
+    void                *cq_ring;
+    size_t               cq_size;
+    size_t               sqes_size;
+    unsigned             tail;          /* our sq tail, ahead of *sq_tail */
+    uint32_t             used;          /* entries in use */
+    uint32_t             inflight;      /* entries not yet completed */
+    struct logw_entry    entries[TOM_LOGW_SLOTS];
+};
+
+static int
+logw_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+logw_enter(struct logw *lw, unsigned submit, unsigned wait)
+{
+    return syscall(__NR_io_uring_enter, lw->fd, submit, wait,
+                   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* grab the next free sqe, there is always room as entries are limited */
+static struct io_uring_sqe *
+logw_sqe(struct logw *lw)
+{
+    struct io_uring_sqe *sqe = &lw->sqes[lw->tail & *lw->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    lw->tail++;
+    return sqe;
+}
+
+/*
+ * make the filled in sqes visible to the kernel and submit them, and
+ * if wait is set, wait for at least that many completions.
+ */
+static int
+logw_submit(struct logw *lw, unsigned wait)
+{
+    unsigned submit;
+    int ret;
+
+    __atomic_store_n(lw->sq_tail, lw->tail, __ATOMIC_RELEASE);
+    submit = lw->tail - __atomic_load_n(lw->sq_head, __ATOMIC_ACQUIRE);
+    do {
+        ret = logw_enter(lw, submit, wait);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        syslog(LOG_ERR, "io_uring_enter(): %m");
+        return TOM_FAIL;
+    }
+    return TOM_OK;
+}
+
+/* pick up any completions, and finish off entries which are done */
+static void
+logw_reap(struct tom *tomi, struct logw *lw)
+{
+    struct io_uring_cqe *cqe;
+    struct logw_entry *e;
+    unsigned head;
+    unsigned tail;
+    int op;
+
+    head = *lw->cq_head;
+    tail = __atomic_load_n(lw->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe = &lw->cqes[head & *lw->cq_mask];
+        e = &lw->entries[cqe->user_data >> 2];
+        op = cqe->user_data & 3;
+
+        if (op == LOGW_OPEN && cqe->res < 0)
+            syslog(LOG_ERR, "Could not open %s for writing: %s", e->path,
+                   strerror(-cqe->res));
+        else if (op == LOGW_WRITE && cqe->res != (int)e->len) {
+            if (cqe->res != -ECANCELED)
+                syslog(LOG_ERR, "Failed to write to %s", e->path);
+        }
+        else if (op == LOGW_WRITE) {
+            /* its on disk */
+            part_account(tomi, &e->host->ip, e->tx, e->rx);
+            e->tx = e->rx = 0;
+        }
+
+        if (--e->pending == 0) {
+            /* didnt make it, so give the counts back to try again */
+            e->host->tx += e->tx;
+            e->host->rx += e->rx;
+            if (e->tx || e->rx)
+                e->host->tz.open = 0;   /* the next record cant be a delta */
+            e->host->logging = 0;
+            lw->inflight--;
+        }
+    }
+    __atomic_store_n(lw->cq_head, head, __ATOMIC_RELEASE);
+
+    if (lw->inflight == 0)
+        lw->used = 0;
+}
+
+/* see if open/write/close into a file slot really work here */
+static int
+logw_probe(struct logw *lw, const char *dir)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int res;
+
+    sqe = logw_sqe(lw);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)dir;
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+    if (logw_submit(lw, 1) != TOM_OK)
+        return TOM_FAIL;
+
+    cqe = &lw->cqes[*lw->cq_head & *lw->cq_mask];
+    res = cqe->res;
+    __atomic_store_n(lw->cq_head, *lw->cq_head + 1, __ATOMIC_RELEASE);
+
+    /* kernels without direct opens hand back a normal fd */
+    if (res > 0)
+        close(res);
+    if (res != 0)
+        return TOM_FAIL;
+
+    sqe = logw_sqe(lw);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+    if (logw_submit(lw, 1) != TOM_OK)
+        return TOM_FAIL;
+    cqe = &lw->cqes[*lw->cq_head & *lw->cq_mask];
+    res = cqe->res;
+    __atomic_store_n(lw->cq_head, *lw->cq_head + 1, __ATOMIC_RELEASE);
+
+    return res == 0 ? TOM_OK : TOM_FAIL;
+}
+
+/*
+ * set up the io_uring writer. on failure tomi->logw stays NULL and logs
+ * are written with stdio as before.
+ */
+int
+logw_init(struct tom *tomi)
+{
+    struct io_uring_params p;
+    struct logw *lw;
+    int fds[TOM_LOGW_SLOTS];
+    int x;
+
+    lw = calloc(1, sizeof(struct logw));
+    if (!lw)
+        err(1, NULL);
+
+    memset(&p, 0, sizeof(p));
+    lw->fd = logw_setup(LOGW_SQES, &p);
+    if (lw->fd == -1) {
+        syslog(LOG_INFO, "io_uring not available (%m), using stdio for logs");
+        free(lw);
+        return TOM_FAIL;
+    }
+
+    lw->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    lw->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (lw->cq_size > lw->sq_size)
+            lw->sq_size = lw->cq_size;
+        lw->cq_size = lw->sq_size;
+    }
+    lw->sq_ring = mmap(NULL, lw->sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, lw->fd, IORING_OFF_SQ_RING);
+    if (lw->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        lw->cq_ring = lw->sq_ring;
+    else {
+        lw->cq_ring = mmap(NULL, lw->cq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, lw->fd,
+                           IORING_OFF_CQ_RING);
+        if (lw->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    lw->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    lw->sqes = mmap(NULL, lw->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, lw->fd, IORING_OFF_SQES);
+    if (lw->sqes == MAP_FAILED)
+        goto fail;
+
+    lw->sq_head = (unsigned *)((char *)lw->sq_ring + p.sq_off.head);
+    lw->sq_tail = (unsigned *)((char *)lw->sq_ring + p.sq_off.tail);
+    lw->sq_mask = (unsigned *)((char *)lw->sq_ring + p.sq_off.ring_mask);
+    lw->cq_head = (unsigned *)((char *)lw->cq_ring + p.cq_off.head);
+    lw->cq_tail = (unsigned *)((char *)lw->cq_ring + p.cq_off.tail);
+    lw->cq_mask = (unsigned *)((char *)lw->cq_ring + p.cq_off.ring_mask);
+    lw->cqes = (struct io_uring_cqe *)((char *)lw->cq_ring + p.cq_off.cqes);
+
+    /* sqes are always used in ring order */
+    unsigned *array = (unsigned *)((char *)lw->sq_ring + p.sq_off.array);
+    for (x=0; x<(int)p.sq_entries; x++)
+        array[x] = x;
+
+    /* one empty file slot per entry */
+    for (x=0; x<TOM_LOGW_SLOTS; x++)
+        fds[x] = -1;
+    if (syscall(__NR_io_uring_register, lw->fd, IORING_REGISTER_FILES,
+                fds, TOM_LOGW_SLOTS) == -1)
+        goto fail;
+
+    if (logw_probe(lw, tomi->log_dir) != TOM_OK) {
+        syslog(LOG_INFO, "io_uring too old, using stdio for logs");
+        errno = 0;
+        goto fail;
+    }
+
+    tomi->logw = lw;
+    syslog(LOG_INFO, "using io_uring for logs");
+    return TOM_OK;
+
+fail:
+    if (errno)
+        syslog(LOG_INFO, "io_uring setup failed (%m), using stdio for logs");
+    if (lw->sqes && lw->sqes != MAP_FAILED)
+        munmap(lw->sqes, lw->sqes_size);
+    if (lw->cq_ring && lw->cq_ring != MAP_FAILED && lw->cq_ring != lw->sq_ring)
+        munmap(lw->cq_ring, lw->cq_size);
+    if (lw->sq_ring && lw->sq_ring != MAP_FAILED)
+        munmap(lw->sq_ring, lw->sq_size);
+    close(lw->fd);
+    free(lw);
+    return TOM_FAIL;
+}
+
+/* wait for everything in flight to finish */
+void
+logw_drain(struct tom *tomi)
+{
+    struct logw *lw = tomi->logw;
+
+    if (!lw)
+        return;
+    while (lw->inflight) {
+        if (logw_submit(lw, 1) != TOM_OK)
+            break;
+        logw_reap(tomi, lw);
+    }
+}
+
+/* finish up and tear down the ring */
+void
+logw_free(struct tom *tomi)
+{
+    struct logw *lw = tomi->logw;
+
+    if (!lw)
+        return;
+    logw_drain(tomi);
+    munmap(lw->sqes, lw->sqes_size);
+    if (lw->cq_ring != lw->sq_ring)
+        munmap(lw->cq_ring, lw->cq_size);
+    munmap(lw->sq_ring, lw->sq_size);
+    close(lw->fd);
+    free(lw);
+    tomi->logw = NULL;
+}
+
+/* collect completions from the last batch, without waiting */
+void
+logw_poll(struct tom *tomi)
+{
+    if (tomi->logw)
+        logw_reap(tomi, tomi->logw);
+}
+
+/*
+ * queue up a log write for h, taking its counters off it. if all the
+ * entries are busy, the batch so far is submitted and we wait for room.
+ */
+int
+logw_queue(struct tom *tomi, struct host *h)
+{
+    struct logw *lw = tomi->logw;
+    struct logw_entry *e;
+    struct io_uring_sqe *sqe;
+    struct timeval now;
+    uint32_t idx;
+    int len;
+
+    if (lw->used == TOM_LOGW_SLOTS) {
+        while (lw->inflight) {
+            if (logw_submit(lw, 1) != TOM_OK)
+                return TOM_FAIL;
+            logw_reap(tomi, lw);
+        }
+    }
+
+    idx = lw->used;
+    e = &lw->entries[idx];
+    if (host_log_path(tomi, h, e->path, sizeof(e->path)) != TOM_OK)
+        return TOM_FAIL;
+    len = host_log_record(tomi, h, e->data, sizeof(e->data));
+    if (len < 0)
+        return TOM_FAIL;
+
+    e->len = len;
+    e->host = h;
+    e->tx = h->tx;
+    e->rx = h->rx;
+    e->pending = 3;
+    lw->used++;
+    lw->inflight++;
+
+    sqe = logw_sqe(lw);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)e->path;
+    sqe->len = 0644;
+    sqe->open_flags = O_WRONLY | O_APPEND | O_CREAT;
+    sqe->file_index = idx + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (idx << 2) | LOGW_OPEN;
+
+    sqe = logw_sqe(lw);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = idx;
+    sqe->addr = (uintptr_t)e->data;
+    sqe->len = e->len;
+    sqe->off = (uint64_t)-1;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;  /* close regardless */
+    sqe->user_data = (idx << 2) | LOGW_WRITE;
+
+    sqe = logw_sqe(lw);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = idx + 1;
+    sqe->user_data = (idx << 2) | LOGW_CLOSE;
+
+    /* the counters are in the entry now, start again from zero */
+    h->tx = 0;
+    h->rx = 0;
+    h->logging = 1;
+    gettimeofday(&now, NULL);
+    h->last_logged = now.tv_sec;
+
+    return TOM_OK;
+}
+
+/* send everything queued off to the kernel, and dont wait for it */
+int
+logw_commit(struct tom *tomi)
+{
+    struct logw *lw = tomi->logw;
+
+    if (!lw || lw->tail == *lw->sq_head)
+        return TOM_OK;
+    return logw_submit(lw, 0);
+}
+
+#else /* no io_uring */
+
+int  logw_init(struct tom *tomi) { return TOM_FAIL; }
+void logw_drain(struct tom *tomi) { }
+void logw_free(struct tom *tomi) { }
+void logw_poll(struct tom *tomi) { }
+int  logw_queue(struct tom *tomi, struct host *h) { return TOM_FAIL; }
+int  logw_commit(struct tom *tomi) { return TOM_OK; }
+
+#endif
@@ -25,24 +25,59 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <signal.h>
 
 #include "tom.h"
 #include "string.h"
 
 char *progname = NULL;  /* for useage() */
 
+/* alert thresholds for a subnet, from -t or the targets file */
+struct limit {
+    struct ip_addr  ip;
+    uint32_t        max_tx;     /* bytes/sec, 0 for no limit */
+    uint32_t        max_rx;
+    struct limit   *next;
+};
+
+volatile sig_atomic_t stopping = 0;
+volatile sig_atomic_t reloading = 0;
+
+/* 
+ * SIGTERM / SIGINT: stop after the current capture, so we can clean up.
+ * the signal interrupts epoll_wait() so that is at most one batch away.
+ */
+void
+sig_stop(int sig)
+{
+    stopping = 1;
+}
+
 /* print usage */
 void
 usage()
 {
 	fprintf(stderr,
             "usage: %s -u username -g groupname -l logidr "
-            "-i interface -t subnet -f (stay in foreground)\n"
+            "-i interface [-i interface ...] -n [addr:]port (flow exports) "
+            "-t subnet -f (stay in foreground) "
+            "-F (flow mode) -T targetsfile (reread on SIGHUP) "
+            "-z (compressed logs) -P day|hour (partitioned logs) "
+            "-a alerthook\n"
+            "-t and the targets file take optional per host rate limits "
+            "in bytes/sec, ie -t 192.168.0.0/24,tx=10M,rx=50M\n"
             "eg: %s -i eth0 -u tom -l /home/tom/iplogs -t 192.168.0.0/24\n",
             progname, progname);
 	exit(1);
 }
 
+/* SIGHUP: reread the targets file next time round the capture loop */
+void
+sig_reload(int sig)
+{
+    reloading = 1;
+}
+
 /* attempt to parse an IP, and return a malloc'ed struct ip_addr if valid */
 struct ip_addr *
 parse_ip(const char *ip)
@@ -78,26 +113,184 @@ parse_ip(const char *ip)
     return ret;
 }
 
+/*
+ * parse the optional rate limits following a subnet, ie the
+ * "tx=10M rx=1G" of "192.168.0.0/24 tx=10M rx=1G", in bytes/sec with an
+ * optional k, M or G. returns -1 if they dont make sense.
+ */
+int
+parse_limits(const char *p, struct limit *lim)
+{
+    unsigned long long v;
+    uint32_t *which;
+    char *end;
+
+    lim->max_tx = 0;
+    lim->max_rx = 0;
+
+    /* skip the subnet itself */
+    p += strcspn(p, " \t,\n");
+    for (;;) {
+        p += strspn(p, " \t,\n");
+        if (*p == '\0' || *p == '#')
+            return 0;
+        if (strncmp(p, "tx=", 3) == 0)
+            which = &lim->max_tx;
+        else if (strncmp(p, "rx=", 3) == 0)
+            which = &lim->max_rx;
+        else
+            return -1;
+
+        v = strtoull(p + 3, &end, 10);
+        if (end == p + 3)
+            return -1;
+        switch (*end) {
+        case 'k': v *= 1000; end++; break;
+        case 'M': v *= 1000000; end++; break;
+        case 'G': v *= 1000000000; end++; break;
+        }
+        if (v == 0 || v > UINT32_MAX || !strchr(" \t,\n", *end))
+            return -1;
+        *which = v;
+        p = end;
+    }
+}
+
+/* apply the rate limits in list to the targets of the same subnet */
+void
+set_limits(struct tom *tomi, struct limit *list)
+{
+    for (; list; list = list->next)
+        tom_set_limit(tomi, &list->ip, list->max_tx, list->max_rx);
+}
+
+/*
+ * build the list of subnets to watch from the -t ones plus the targets
+ * file (one subnet per line, # for comments, with optional rate limits
+ * as for -t), and hand it to tom_set_targets(). on any error the current
+ * targets are left alone.
+ */
+int
+load_targets(struct tom *tomi, struct ip_addr *cmdline,
+             struct limit *cmdlimits, const char *path)
+{
+    struct ip_addr *list = NULL;
+    struct ip_addr **tail = &list;
+    struct ip_addr *ip;
+    struct ip_addr *next;
+    struct limit   *limits = NULL;
+    struct limit   *lim;
+    struct limit    tmplim;
+    FILE           *fh;
+    char            line[128];
+    char           *p;
+    int             lineno = 0;
+    int             ret = TOM_FAIL;
+
+    /*
+     * targets match first wins, so keep them in the order given: -t ones
+     * (held newest first, so this puts them back) then the file's.
+     */
+    for (ip = cmdline; ip; ip = ip->next) {
+        next = malloc(sizeof(struct ip_addr));
+        if (!next)
+            err(1, NULL);
+        *next = *ip;
+        next->next = list;
+        list = next;
+    }
+    while (*tail)
+        tail = &(*tail)->next;
+
+    if (path[0] != '\0') {
+        if (!(fh = fopen(path, "r"))) {
+            syslog(LOG_ERR, "Could not open %s: %m", path);
+            goto done;
+        }
+        while (fgets(line, sizeof(line), fh)) {
+            lineno++;
+            p = line + strspn(line, " \t");
+            if (*p == '#' || *p == '\n' || *p == '\0')
+                continue;
+            if (!(ip = parse_ip(p))) {
+                syslog(LOG_ERR, "%s:%d: invalid subnet", path, lineno);
+                fclose(fh);
+                goto done;
+            }
+            ip->next = NULL;
+            *tail = ip;
+            tail = &ip->next;
+
+            if (parse_limits(p, &tmplim) == -1) {
+                syslog(LOG_ERR, "%s:%d: invalid rate limit", path, lineno);
+                fclose(fh);
+                goto done;
+            }
+            if (tmplim.max_tx || tmplim.max_rx) {
+                if (!(lim = malloc(sizeof(struct limit))))
+                    err(1, NULL);
+                *lim = tmplim;
+                lim->ip = *ip;
+                lim->next = limits;
+                limits = lim;
+            }
+        }
+        fclose(fh);
+    }
+
+    ret = tom_set_targets(tomi, list);
+    if (ret != TOM_OK)
+        syslog(LOG_ERR, "invalid or no target subnets given");
+    else {
+        set_limits(tomi, cmdlimits);
+        set_limits(tomi, limits);
+    }
+
+done:
+    while (list) {
+        next = list->next;
+        free(list);
+        list = next;
+    }
+    while (limits) {
+        lim = limits->next;
+        free(limits);
+        limits = lim;
+    }
+    return ret;
+}
+
 int 
 main(int argc, char **argv) 
 {
     struct tom      tomi;
     int             dontfork = 0;
+    int             flowmode = 0;
+    int             logflags = 0;
     int             oret;
-    char interface[64]       = { '\0' };
+    int             x;
+    char           *interfaces[TOM_MAX_IFACES];
+    int             ninterfaces = 0;
+    char           *collectors[TOM_MAX_IFACES];
+    int             ncollectors = 0;
     char logdir[256]         = { '\0' };
     char user[64]            = { '\0' };
     char group[64]           = { '\0' };
+    char targetfile[256]     = { '\0' };
+    char           *alerthook = NULL;
     uid_t           uid;
     gid_t           gid;
     struct ip_addr *targets  = NULL;
     struct ip_addr *ipret    = NULL;
+    struct limit   *limits   = NULL;
+    struct limit   *lim;
+    struct limit    tmplim;
     struct passwd  *pw       = NULL;
     struct group   *gr       = NULL;
 
     progname = argv[0];
 
-    while ((oret = getopt(argc, argv, "fi:l:t:u:g:")) != -1) {
+    while ((oret = getopt(argc, argv, "a:fFi:l:n:P:t:T:u:g:z")) != -1) {
         switch (oret) {
         case 'u':
             /* user name */
@@ -113,9 +306,35 @@ main(int argc, char **argv)
             /* dont fork, stay in foreground */
             dontfork = 1;
             break;
+        case 'F':
+            /* account per flow / service as well as per host */
+            flowmode = 1;
+            break;
+        case 'z':
+            /* delta / varint encoded host logs, read them with tomdump */
+            logflags |= TOM_LOG_TZ;
+            break;
+        case 'P':
+            /* log_dir/YYYYMMDD[HH]/<ip> instead of log_dir/<ip> */
+            logflags &= ~(TOM_LOG_DAY | TOM_LOG_HOUR);
+            if (strcmp(optarg, "day") == 0)
+                logflags |= TOM_LOG_DAY;
+            else if (strcmp(optarg, "hour") == 0)
+                logflags |= TOM_LOG_HOUR;
+            else
+                errx(1, "-P takes day or hour, not %s", optarg);
+            break;
         case 'i':
-            /* interface name */
-            strlcpy(interface, optarg, sizeof(interface));
+            /* interface name, can be given more than once */
+            if (ninterfaces >= TOM_MAX_IFACES)
+                errx(1, "too many interfaces, max is %d", TOM_MAX_IFACES);
+            interfaces[ninterfaces++] = optarg;
+            break;
+        case 'n':
+            /* listen for NetFlow / IPFIX exports, instead of or as well as -i */
+            if (ncollectors >= TOM_MAX_IFACES)
+                errx(1, "too many flow listeners, max is %d", TOM_MAX_IFACES);
+            collectors[ncollectors++] = optarg;
             break;
         case 'l':
             /* log directory */
@@ -125,6 +344,16 @@ main(int argc, char **argv)
             /* target subnet */
             if (!(ipret = parse_ip(optarg)))
                 errx(1, "%s is a invalid ip address", optarg);
+            if (parse_limits(optarg, &tmplim) == -1)
+                errx(1, "%s has an invalid rate limit", optarg);
+            if (tmplim.max_tx || tmplim.max_rx) {
+                if (!(lim = malloc(sizeof(struct limit))))
+                    err(1, NULL);
+                *lim = tmplim;
+                lim->ip = *ipret;
+                lim->next = limits;
+                limits = lim;
+            }
             if (!targets)
                 targets = ipret;
             else {
@@ -132,14 +361,24 @@ main(int argc, char **argv)
                 targets = ipret;
             }
             break;
+        case 'a':
+            /* run this when a host goes over its subnets rate limit */
+            alerthook = optarg;
+            break;
+        case 'T':
+            /* file of target subnets */
+            if (strlcpy(targetfile, optarg, sizeof(targetfile)) >=
+                sizeof(targetfile))
+                errx(1, "targets file name too long");
+            break;
         default: 
             usage();
             /* NOT REACHED */
         }
     }
 
-    if (interface[0] == '\0')
-        errx(1, "No interface name given");
+    if (ninterfaces == 0 && ncollectors == 0)
+        errx(1, "No interface name or flow listener given");
     if (logdir[0] == '\0')
         errx(1, "No log directory given");
 
@@ -159,7 +398,7 @@ main(int argc, char **argv)
             gid = gr->gr_gid;
     }
 
-    if (targets == NULL)
+    if (targets == NULL && targetfile[0] == '\0')
         errx(1, "No target subnets given");
 
     /* sort out syslog */
@@ -168,19 +407,33 @@ main(int argc, char **argv)
 
 
     /* open/setup pcap and what not */
-    if (tom_init(&tomi, interface, logdir) != TOM_OK)
+    if (tom_init(&tomi, logdir, logflags) != TOM_OK)
         return 1;
-
-    /* add the ip addresses we want to monitor */
-    ipret = targets;
-    while (targets) {
-        if (tom_add_target(&tomi, targets) != TOM_OK)
-            errx(1, "invalid target ip address");
-        ipret = targets->next;
-        free(targets);
-        targets = ipret;
+    for (x=0; x<ninterfaces; x++) {
+        if (tom_add_interface(&tomi, interfaces[x]) != TOM_OK) {
+            tom_free(&tomi);
+            return 1;
+        }
+    }
+    for (x=0; x<ncollectors; x++) {
+        if (tom_add_collector(&tomi, collectors[x]) != TOM_OK) {
+            warnx("can't listen for flows on %s", collectors[x]);
+            tom_free(&tomi);
+            return 1;
+        }
     }
-    targets = NULL;
+
+    if (flowmode)
+        flow_init(&tomi);
+    if (alerthook)
+        tom_set_alert_hook(&tomi, alerthook);
+
+    /* 
+     * add the ip addresses we want to monitor. the -t list is kept, as
+     * it gets merged with the targets file again on every reload.
+     */
+    if (load_targets(&tomi, targets, limits, targetfile) != TOM_OK)
+        errx(1, "invalid target ip address");
 
     syslog(LOG_INFO, "Dropping priledges");
     if (setregid(gid, gid) == -1)
@@ -193,18 +446,59 @@ main(int argc, char **argv)
         if (daemon(1, 0))
             err(1, "daemon()");
     }
+    /* catch shutdown signals so unlogged data can be written out */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_stop;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGTERM, &sa, NULL) == -1 ||
+        sigaction(SIGINT, &sa, NULL) == -1)
+        err(1, "sigaction()");
+
+    /* 
+     * and SIGHUP to reload the targets. note the file is reread after
+     * dropping priviledges, so it needs to be readable by that user.
+     */
+    sa.sa_handler = sig_reload;
+    if (sigaction(SIGHUP, &sa, NULL) == -1)
+        err(1, "sigaction()");
+
+    /* alert hooks are not waited for, let the kernel reap them */
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGCHLD, &sa, NULL) == -1)
+        err(1, "sigaction()");
+
     syslog(LOG_INFO, "started");
 
-    /* int x = 0; */
-    while (tom_capture_one(&tomi) != TOM_FAIL) { 
-        /* DEBUG ONLY: wont be running purge each capture */
-        host_purge(&tomi);
-        /* x++; */
-        /* printf("%i\n", x); */
-        /* if (x > 100) */
-        /*     break; */
+    while (!stopping) {
+        oret = tom_capture(&tomi);
+        if (oret == TOM_FAIL || oret == TOM_STOPPED)
+            break;
+        if (reloading) {
+            reloading = 0;
+            if (load_targets(&tomi, targets, limits, targetfile) == TOM_OK)
+                syslog(LOG_INFO, "reloaded targets");
+        }
+        tom_housekeep(&tomi);
     }
 
+    /* write out whatever is still pending, and a snapshot to restart from */
+    syslog(LOG_INFO, "shutting down, flushing %u hosts", tomi.hosts_size);
+    host_flush(&tomi);
+    target_housekeep(&tomi, 1);
+    flow_housekeep(&tomi, 1);
+    tom_state_save(&tomi);
+
     tom_free(&tomi);
+    while (targets) {
+        ipret = targets->next;
+        free(targets);
+        targets = ipret;
+    }
+    while (limits) {
+        lim = limits->next;
+        free(limits);
+        limits = lim;
+    }
     return 0;
 }
@@ -0,0 +1,539 @@
+/*
+ * Copyright (c) 2012 Joshua Sandbrook.  All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * flow collector (-n). instead of sniffing packets, listen on a udp
+ * socket for NetFlow v5, v9 or IPFIX exports from a router and account
+ * the byte counts of each ip4 flow record just like a captured packet.
+ * datagrams are read TOM_NF_BATCH at a time with recvmmsg() into
+ * buffers allocated with the collector, and records are decoded in
+ * place, so nothing is allocated per record. v9/ipfix templates are kept
+ * in a fixed table per collector, with the offsets of the fields we care
+ * about worked out when the template arrives.
+ */
+
+#define _GNU_SOURCE     /* recvmmsg() */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "tom.h"
+#include "string.h"
+
+#define NF_16(p)    (((p)[0] << 8) | (p)[1])
+#define NF_32(p)    ((uint32_t)nf_get((p), 4))
+
+#define NF_FIELDS   64      /* max fields in a template we can walk */
+#define NF_VARLEN   65535   /* ipfix variable length field */
+#define NF_RCVBUF   (4 * 1024 * 1024)
+
+/* the fields we pull out of each record */
+enum {
+    NF_SRC = 0,     /* sourceIPv4Address, 8 */
+    NF_DST,         /* destinationIPv4Address, 12 */
+    NF_BYTES,       /* octetDeltaCount / IN_BYTES, 1 */
+    NF_OUTBYTES,    /* OUT_BYTES, 23. only used if there is no IN_BYTES */
+    NF_PROTO,       /* protocolIdentifier, 4 */
+    NF_SPORT,       /* sourceTransportPort, 7 */
+    NF_DPORT,       /* destinationTransportPort, 11 */
+    NF_NWANT
+};
+
+struct nf_want {
+    uint16_t off;
+    uint16_t len;           /* 0 if the template doesnt have it */
+};
+
+struct nf_field {
+    uint16_t type;
+    uint16_t len;
+};
+
+struct nf_template {
+    uint32_t        exporter;   /* exporter address, network order */
+    uint32_t        domain;     /* v9 source id / ipfix observation domain */
+    uint16_t        version;
+    uint16_t        id;         /* template id, 0 if the slot is free */
+    uint16_t        reclen;     /* record length, 0 if it varies */
+    uint16_t        nfields;
+    struct nf_want  want[NF_NWANT];     /* only valid if reclen != 0 */
+    struct nf_field fields[NF_FIELDS];  /* for walking variable records */
+};
+
+struct nf_collector {
+    struct mmsghdr     msgs[TOM_NF_BATCH];
+    struct iovec       iovs[TOM_NF_BATCH];
+    struct sockaddr_in addrs[TOM_NF_BATCH];
+    uint8_t            bufs[TOM_NF_BATCH][TOM_NF_BUFSIZE];
+    struct nf_template templates[TOM_NF_TEMPLATES];
+    uint32_t           next_template;  /* slot to reuse when all are taken */
+};
+
+/* read a big endian unsigned int of len bytes */
+static uint64_t
+nf_get(const uint8_t *p, int len)
+{
+    uint64_t v = 0;
+
+    while (len-- > 0)
+        v = (v << 8) | *p++;
+    return v;
+}
+
+/* map an information element / field type to NF_*, or -1 */
+static int
+nf_want_index(uint16_t type)
+{
+    switch (type) {
+    case 8:  return NF_SRC;
+    case 12: return NF_DST;
+    case 1:  return NF_BYTES;
+    case 23: return NF_OUTBYTES;
+    case 4:  return NF_PROTO;
+    case 7:  return NF_SPORT;
+    case 11: return NF_DPORT;
+    }
+    return -1;
+}
+
+/* account a single decoded flow record */
+static void
+nf_account(struct tom *tomi, struct pcap_pkthdr *hdr, struct ip_pair *pair,
+           const uint8_t *src, const uint8_t *dst, uint64_t bytes)
+{
+    memcpy(pair->src.addr, src, 4);
+    memcpy(pair->dst.addr, dst, 4);
+    tom_account(tomi, hdr, pair, bytes);
+}
+
+/* NetFlow v5: fixed 24 byte header and 48 byte records */
+static int
+nf_decode_v5(struct tom *tomi, struct pcap_pkthdr *hdr, struct ip_pair *pair,
+             const uint8_t *p, size_t len)
+{
+    const uint8_t *rec;
+    uint16_t count;
+    uint16_t sampling;
+    uint32_t scale = 1;
+    int x;
+
+    if (len < 24)
+        return TOM_INVALID;
+    count = NF_16(p + 2);
+    if (len < 24 + (size_t)count * 48)
+        return TOM_INVALID;
+
+    /* scale up sampled exports, the interval is the low 14 bits */
+    sampling = NF_16(p + 22);
+    if ((sampling >> 14) && (sampling & 0x3fff) > 1)
+        scale = sampling & 0x3fff;
+
+    for (x=0, rec=p+24; x<count; x++, rec+=48) {
+        pair->proto = rec[38];
+        pair->sport = NF_16(rec + 32);
+        pair->dport = NF_16(rec + 34);
+        nf_account(tomi, hdr, pair, rec, rec + 4,
+                   (uint64_t)NF_32(rec + 20) * scale);
+    }
+    return TOM_OK;
+}
+
+/* find the template for (exporter, domain, version, id), or NULL */
+static struct nf_template *
+nf_template_find(struct nf_collector *nf, uint32_t exporter, uint32_t domain,
+                 uint16_t version, uint16_t id)
+{
+    struct nf_template *t;
+    int x;
+
+    for (x=0; x<TOM_NF_TEMPLATES; x++) {
+        t = &nf->templates[x];
+        if (t->id == id && t->exporter == exporter && t->domain == domain &&
+            t->version == version)
+            return t;
+    }
+    return NULL;
+}
+
+/* parse a v9 or ipfix template set, p to end being the sets contents */
+static void
+nf_templates(struct nf_collector *nf, uint32_t exporter, uint32_t domain,
+             uint16_t version, const uint8_t *p, const uint8_t *end)
+{
+    struct nf_template *t;
+    uint16_t id;
+    uint16_t nfields;
+    uint16_t type;
+    uint16_t flen;
+    uint32_t off;
+    int w;
+    int f;
+
+    while (p + 4 <= end) {
+        id = NF_16(p);
+        nfields = NF_16(p + 2);
+        p += 4;
+        if (id < 256)
+            return;     /* padding, or junk */
+
+        t = nf_template_find(nf, exporter, domain, version, id);
+        if (!t) {
+            t = nf_template_find(nf, 0, 0, 0, 0);  /* free slot? */
+            if (!t) {
+                t = &nf->templates[nf->next_template];
+                nf->next_template = (nf->next_template + 1) % TOM_NF_TEMPLATES;
+            }
+        }
+        memset(t, 0, sizeof(struct nf_template));
+
+        off = 0;
+        for (f=0; f<nfields; f++) {
+            if (p + 4 > end)
+                goto invalid;
+            type = NF_16(p);
+            flen = NF_16(p + 2);
+            p += 4;
+            if (version == 10 && (type & 0x8000)) {
+                /* enterprise specific, never one of ours */
+                if (p + 4 > end)
+                    goto invalid;
+                p += 4;
+                type = 0;
+            }
+
+            if (f < NF_FIELDS) {
+                t->fields[f].type = type;
+                t->fields[f].len = flen;
+            }
+            if (flen == NF_VARLEN || off == 0xffffffff) {
+                off = 0xffffffff;   /* records vary in length */
+                continue;
+            }
+            w = nf_want_index(type);
+            if (w >= 0 && flen <= 8) {
+                t->want[w].off = off;
+                t->want[w].len = flen;
+            }
+            off += flen;
+        }
+
+        /* withdrawn, or too many variable length fields to walk */
+        if (nfields == 0 || (off == 0xffffffff && nfields > NF_FIELDS) ||
+            (off != 0xffffffff && (off == 0 || off > TOM_NF_BUFSIZE)))
+            continue;
+
+        t->exporter = exporter;
+        t->domain = domain;
+        t->version = version;
+        t->nfields = nfields;
+        t->reclen = off == 0xffffffff ? 0 : off;
+        t->id = id;
+    }
+    return;
+
+invalid:
+    t->id = 0;
+}
+
+/*
+ * work out where the fields are in a record of a variable length
+ * template. returns the record length, or 0 if it runs past end.
+ */
+static size_t
+nf_walk(struct nf_template *t, const uint8_t *p, const uint8_t *end,
+        struct nf_want *want)
+{
+    const uint8_t *start = p;
+    size_t flen;
+    int w;
+    int f;
+
+    memset(want, 0, sizeof(struct nf_want) * NF_NWANT);
+    for (f=0; f<t->nfields; f++) {
+        flen = t->fields[f].len;
+        if (flen == NF_VARLEN) {
+            if (p >= end)
+                return 0;
+            flen = *p++;
+            if (flen == 255) {
+                if (p + 2 > end)
+                    return 0;
+                flen = NF_16(p);
+                p += 2;
+            }
+        }
+        if (p + flen > end)
+            return 0;
+        w = nf_want_index(t->fields[f].type);
+        if (w >= 0 && flen <= 8) {
+            want[w].off = p - start;
+            want[w].len = flen;
+        }
+        p += flen;
+    }
+    return p - start;
+}
+
+/* decode the records of a v9 or ipfix data set */
+static void
+nf_data(struct tom *tomi, struct pcap_pkthdr *hdr, struct ip_pair *pair,
+        struct nf_template *t, const uint8_t *p, const uint8_t *end)
+{
+    struct nf_want walked[NF_NWANT];
+    struct nf_want *want = t->want;
+    struct nf_want *bytes;
+    size_t reclen = t->reclen;
+
+    while (p < end) {
+        if (!t->reclen) {
+            want = walked;
+            reclen = nf_walk(t, p, end, walked);
+            if (!reclen)
+                break;
+        }
+        else if (p + reclen > end)
+            break;  /* padding */
+
+        bytes = want[NF_BYTES].len ? &want[NF_BYTES] : &want[NF_OUTBYTES];
+        if (want[NF_SRC].len == 4 && want[NF_DST].len == 4 && bytes->len) {
+            pair->proto = want[NF_PROTO].len ?
+                nf_get(p + want[NF_PROTO].off, want[NF_PROTO].len) : 0;
+            pair->sport = want[NF_SPORT].len ?
+                nf_get(p + want[NF_SPORT].off, want[NF_SPORT].len) : 0;
+            pair->dport = want[NF_DPORT].len ?
+                nf_get(p + want[NF_DPORT].off, want[NF_DPORT].len) : 0;
+            nf_account(tomi, hdr, pair, p + want[NF_SRC].off,
+                       p + want[NF_DST].off, nf_get(p + bytes->off, bytes->len));
+        }
+        p += reclen;
+    }
+}
+
+/*
+ * NetFlow v9 and IPFIX share the same set layout, they just differ in
+ * the header and which set ids hold templates.
+ */
+static int
+nf_decode_sets(struct tom *tomi, struct nf_collector *nf,
+               struct pcap_pkthdr *hdr, struct ip_pair *pair,
+               uint32_t exporter, const uint8_t *p, size_t len)
+{
+    const uint8_t *end;
+    struct nf_template *t;
+    uint16_t version;
+    uint16_t tmpl_set;
+    uint16_t id;
+    uint16_t slen;
+    uint32_t domain;
+
+    version = NF_16(p);
+    if (version == 9) {
+        if (len < 20)
+            return TOM_INVALID;
+        domain = NF_32(p + 16);
+        end = p + len;
+        p += 20;
+        tmpl_set = 0;
+    }
+    else {
+        if (len < 16 || (size_t)NF_16(p + 2) > len)
+            return TOM_INVALID;
+        domain = NF_32(p + 12);
+        end = p + NF_16(p + 2);
+        p += 16;
+        tmpl_set = 2;
+    }
+
+    while (p + 4 <= end) {
+        id = NF_16(p);
+        slen = NF_16(p + 2);
+        if (slen < 4 || p + slen > end)
+            return TOM_INVALID;
+
+        if (id == tmpl_set)
+            nf_templates(nf, exporter, domain, version, p + 4, p + slen);
+        else if (id >= 256) {
+            t = nf_template_find(nf, exporter, domain, version, id);
+            if (t)
+                nf_data(tomi, hdr, pair, t, p + 4, p + slen);
+        }
+        /* options templates (and their data) are of no use to us */
+
+        p += slen;
+    }
+    return TOM_OK;
+}
+
+/* decode a single export datagram */
+static int
+nf_decode(struct tom *tomi, struct nf_collector *nf, struct pcap_pkthdr *hdr,
+          uint32_t exporter, const uint8_t *p, size_t len)
+{
+    struct ip_pair pair;
+
+    if (len < 4)
+        return TOM_INVALID;
+
+    memset(&pair, 0, sizeof(pair));
+    pair.src.type = TOM_IP4;
+    pair.src.mask = 32;
+    pair.dst.type = TOM_IP4;
+    pair.dst.mask = 32;
+
+    switch (NF_16(p)) {
+    case 5:
+        return nf_decode_v5(tomi, hdr, &pair, p, len);
+    case 9:
+    case 10:
+        return nf_decode_sets(tomi, nf, hdr, &pair, exporter, p, len);
+    }
+    return TOM_SKIPPED;
+}
+
+/*
+ * read and decode whatever datagrams are waiting on a collector socket,
+ * up to TOM_NF_BATCH of them. the time they arrived is used as the time
+ * of the traffic.
+ */
+int
+nf_read(struct tom *tomi, struct iface *ifc)
+{
+    struct nf_collector *nf = ifc->nf;
+    struct pcap_pkthdr hdr;
+    int n;
+    int x;
+
+    for (x=0; x<TOM_NF_BATCH; x++)
+        nf->msgs[x].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+    n = recvmmsg(ifc->fd, nf->msgs, TOM_NF_BATCH, MSG_DONTWAIT, NULL);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return TOM_OK;
+        syslog(LOG_ERR, "%s: recvmmsg(): %m", ifc->name);
+        return TOM_FAIL;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    gettimeofday(&hdr.ts, NULL);
+    for (x=0; x<n; x++) {
+        if (nf_decode(tomi, nf, &hdr, nf->addrs[x].sin_addr.s_addr,
+                      nf->bufs[x], nf->msgs[x].msg_len) == TOM_INVALID)
+            syslog(LOG_DEBUG, "%s: bad flow export from %s", ifc->name,
+                   inet_ntoa(nf->addrs[x].sin_addr));
+    }
+    return TOM_OK;
+}
+
+/* free the collector state of an iface, if it has any */
+void
+nf_free(struct iface *ifc)
+{
+    free(ifc->nf);
+    ifc->nf = NULL;
+}
+
+/*
+ * listen for flow exports on [address:]port, and add the socket to the
+ * set tom_capture() waits on.
+ */
+int
+tom_add_collector(struct tom *tomi, const char *listen)
+{
+    struct iface *ifc;
+    struct nf_collector *nf;
+    struct sockaddr_in sin;
+    char addr[64];
+    const char *port;
+    char *ep;
+    unsigned long portnum;
+    int bufsize = NF_RCVBUF;
+    int x;
+
+    if (!tomi || !listen)
+        return TOM_INVALID;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    port = strrchr(listen, ':');
+    if (port) {
+        if ((size_t)(port - listen) >= sizeof(addr))
+            return TOM_INVALID;
+        memcpy(addr, listen, port - listen);
+        addr[port - listen] = '\0';
+        if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1)
+            return TOM_INVALID;
+        port++;
+    }
+    else
+        port = listen;
+    portnum = strtoul(port, &ep, 10);
+    if (*port == '\0' || *ep != '\0' || portnum == 0 || portnum > 65535)
+        return TOM_INVALID;
+    sin.sin_port = htons(portnum);
+
+    if (!(ifc = iface_alloc(tomi, listen)))
+        return TOM_INVALID;
+
+    ifc->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ifc->fd == -1) {
+        syslog(LOG_EMERG, "socket(): %m");
+        warn("socket()");
+        iface_remove(tomi, ifc);
+        return TOM_FAIL;
+    }
+
+    /* exports come in bursts, give the kernel room to queue them */
+    setsockopt(ifc->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    if (bind(ifc->fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+        syslog(LOG_EMERG, "%s: bind(): %m", listen);
+        warn("%s: bind()", listen);
+        iface_remove(tomi, ifc);
+        return TOM_FAIL;
+    }
+
+    nf = calloc(1, sizeof(struct nf_collector));
+    if (!nf)
+        err(1, NULL);
+    for (x=0; x<TOM_NF_BATCH; x++) {
+        nf->iovs[x].iov_base = nf->bufs[x];
+        nf->iovs[x].iov_len = TOM_NF_BUFSIZE;
+        nf->msgs[x].msg_hdr.msg_iov = &nf->iovs[x];
+        nf->msgs[x].msg_hdr.msg_iovlen = 1;
+        nf->msgs[x].msg_hdr.msg_name = &nf->addrs[x];
+        nf->msgs[x].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    ifc->nf = nf;
+
+    if (iface_attach(tomi, ifc) != TOM_OK) {
+        iface_remove(tomi, ifc);
+        return TOM_FAIL;
+    }
+
+    return TOM_OK;
+}
@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2012 Joshua Sandbrook.  All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * time partitioned host logs (-P day|hour). instead of one flat
+ * log_dir/<ip> per host forever, host logs go to log_dir/YYYYMMDD/<ip>
+ * (or YYYYMMDDHH), in UTC so hour partitions dont collide over DST. the
+ * subnets/, flows/ and services/ logs go under the partition too.
+ *
+ * when the partition changes every host, subnet and flow is flushed
+ * into the old one, and then it is sealed: log_dir/<partition>/TOM_PART_INDEX gets one
+ * "<ip> <tx> <rx>" line per host in it, with its totals for the whole
+ * partition. the totals are kept in memory as records are written, so
+ * sealing never reads logs back while capturing. the only time logs
+ * are read is at startup, before capture begins: to seed the totals of
+ * the current partition, if we are restarting part way through it, and
+ * to seal any partitions that ended while we were down.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "tom.h"
+#include "string.h"
+
+#define PART_MASK   (TOM_PART_BUCKETS - 1)
+
+/* totals for one host in the current partition */
+struct part_host {
+    uint8_t           addr[TOM_ADDR_SIZE];
+    uint8_t           type;
+    uint64_t          tx;
+    uint64_t          rx;
+    struct part_host *next;
+};
+
+struct part_table {
+    struct part_host *buckets[TOM_PART_BUCKETS];
+};
+
+/* name of the partition the given time falls in */
+static void
+part_name(struct tom *tomi, time_t t, char *buff, size_t buff_size)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buff, buff_size,
+             (tomi->log_flags & TOM_LOG_HOUR) ? "%Y%m%d%H" : "%Y%m%d", &tm);
+}
+
+/* does the directory entry look like a partition? */
+static int
+part_is_name(const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len != 8 && len != 10)
+        return 0;
+    return strspn(name, "0123456789") == len;
+}
+
+/* drop all the totals, ie for the start of a new partition */
+static void
+part_clear(struct part_table *pt)
+{
+    struct part_host *ph;
+    struct part_host *next;
+    int x;
+
+    for (x=0; x<TOM_PART_BUCKETS; x++) {
+        for (ph = pt->buckets[x]; ph; ph = next) {
+            next = ph->next;
+            free(ph);
+        }
+        pt->buckets[x] = NULL;
+    }
+}
+
+/* add tx/rx to the totals for ip */
+static void
+part_add(struct part_table *pt, struct ip_addr *ip, uint64_t tx, uint64_t rx)
+{
+    struct part_host *ph;
+    uint8_t addr[TOM_ADDR_SIZE];
+    uint32_t b;
+
+    /* only the bytes the address type uses, the rest may be anything */
+    memset(addr, 0, sizeof(addr));
+    memcpy(addr, ip->addr, ip->type == TOM_IP4 ? 4 : TOM_ADDR_SIZE);
+
+    b = tom_hash16(addr) & PART_MASK;
+    for (ph = pt->buckets[b]; ph; ph = ph->next) {
+        if (ph->type == ip->type &&
+            memcmp(ph->addr, addr, TOM_ADDR_SIZE) == 0)
+            break;
+    }
+    if (!ph) {
+        ph = calloc(1, sizeof(struct part_host));
+        if (!ph)
+            err(1, NULL);
+        memcpy(ph->addr, addr, TOM_ADDR_SIZE);
+        ph->type = ip->type;
+        ph->next = pt->buckets[b];
+        pt->buckets[b] = ph;
+    }
+    ph->tx += tx;
+    ph->rx += rx;
+}
+
+/* add a record which made it into the current partition to the totals */
+void
+part_account(struct tom *tomi, struct ip_addr *ip, uint64_t tx, uint64_t rx)
+{
+    if (tomi->part)
+        part_add(tomi->part, ip, tx, rx);
+}
+
+/* total up one host log file, plain or compressed */
+static int
+part_read_log(const char *path, int tz, uint64_t *tx, uint64_t *rx)
+{
+    struct tz_reader r;
+    uint32_t epoch;
+    uint64_t otx;
+    uint64_t orx;
+    unsigned long long ltx;
+    unsigned long long lrx;
+    FILE *fh;
+    int ret;
+
+    *tx = 0;
+    *rx = 0;
+    if (tz) {
+        if (tz_open(&r, path, 0) == -1)
+            return TOM_FAIL;
+        while ((ret = tz_next(&r, &epoch, &otx, &orx)) == 1) {
+            *tx += otx;
+            *rx += orx;
+        }
+        if (ret == -1 || r.skipped)
+            syslog(LOG_ERR, "%s is corrupt, totals are short", path);
+        tz_close(&r);
+        return TOM_OK;
+    }
+
+    fh = fopen(path, "r");
+    if (!fh)
+        return TOM_FAIL;
+    while (fscanf(fh, "%u %llu %llu", &epoch, &ltx, &lrx) == 3) {
+        *tx += ltx;
+        *rx += lrx;
+    }
+    fclose(fh);
+    return TOM_OK;
+}
+
+/*
+ * add the totals of every host log in partition name to the table. only
+ * used at startup, as it reads back the whole partition.
+ */
+static int
+part_load(struct tom *tomi, const char *name)
+{
+    struct ip_addr ip;
+    struct dirent *de;
+    char dir[256];
+    char logpath[256];
+    char ipbuff[64];
+    uint64_t tx;
+    uint64_t rx;
+    size_t len;
+    DIR *dh;
+    int tz;
+
+    if (tom_log_path(tomi, name, NULL, dir, sizeof(dir)) != TOM_OK)
+        return TOM_FAIL;
+    if (!(dh = opendir(dir))) {
+        syslog(LOG_ERR, "Could not read %s: %m", dir);
+        return TOM_FAIL;
+    }
+
+    memset(&ip, 0, sizeof(ip));
+    ip.type = TOM_IP4;
+    while ((de = readdir(dh))) {
+        /* host logs are <ip> or <ip>.tz, everything else is skipped */
+        len = strlen(de->d_name);
+        tz = len > 3 && strcmp(de->d_name + len - 3, TZ_SUFFIX) == 0;
+        if (tz)
+            len -= 3;
+        if (len >= sizeof(ipbuff))
+            continue;
+        memcpy(ipbuff, de->d_name, len);
+        ipbuff[len] = '\0';
+        if (inet_pton(AF_INET, ipbuff, ip.addr) != 1)
+            continue;
+
+        if (tom_log_path(tomi, name, de->d_name, logpath,
+                         sizeof(logpath)) != TOM_OK ||
+            part_read_log(logpath, tz, &tx, &rx) != TOM_OK)
+            continue;
+        part_add(tomi->part, &ip, tx, rx);
+    }
+    closedir(dh);
+    return TOM_OK;
+}
+
+/* write the index for partition name from the totals in the table */
+static int
+part_seal(struct tom *tomi, const char *name)
+{
+    struct part_table *pt = tomi->part;
+    struct part_host *ph;
+    struct ip_addr ip;
+    char path[256];
+    char tmppath[256];
+    char ipbuff[64];
+    FILE *fh;
+    int x;
+
+    if (tom_log_path(tomi, name, TOM_PART_INDEX, path, sizeof(path)) != TOM_OK ||
+        tom_log_path(tomi, name, TOM_PART_INDEX ".tmp", tmppath,
+                     sizeof(tmppath)) != TOM_OK)
+        return TOM_FAIL;
+
+    fh = fopen(tmppath, "w");
+    if (!fh) {
+        syslog(LOG_ERR, "Could not open %s for writing", tmppath);
+        return TOM_FAIL;
+    }
+
+    memset(&ip, 0, sizeof(ip));
+    for (x=0; x<TOM_PART_BUCKETS; x++) {
+        for (ph = pt->buckets[x]; ph; ph = ph->next) {
+            memcpy(ip.addr, ph->addr, TOM_ADDR_SIZE);
+            ip.type = ph->type;
+            ip_str(&ip, ipbuff, sizeof(ipbuff));
+            if (fprintf(fh, "%s %llu %llu\n", ipbuff,
+                        (unsigned long long)ph->tx,
+                        (unsigned long long)ph->rx) < 0)
+                goto fail;
+        }
+    }
+
+    if (fflush(fh) != 0 || fsync(fileno(fh)) == -1)
+        goto fail;
+    if (fclose(fh) != 0) {
+        fh = NULL;
+        goto fail;
+    }
+    fh = NULL;
+    if (rename(tmppath, path) == -1)
+        goto fail;
+
+    syslog(LOG_INFO, "sealed log partition %s", name);
+    return TOM_OK;
+
+fail:
+    syslog(LOG_ERR, "Failed to seal log partition %s: %m", name);
+    if (fh)
+        fclose(fh);
+    unlink(tmppath);
+    return TOM_FAIL;
+}
+
+/*
+ * seal any old partitions which were left without an index, ie as we
+ * were not running when they ended. uses the table, so has to be done
+ * before it is seeded for the current partition.
+ */
+static void
+part_seal_old(struct tom *tomi)
+{
+    struct dirent *de;
+    struct stat st;
+    char path[256];
+    DIR *dh;
+
+    if (!(dh = opendir(tomi->log_dir)))
+        return;
+    while ((de = readdir(dh))) {
+        if (!part_is_name(de->d_name) ||
+            strcmp(de->d_name, tomi->partition) == 0)
+            continue;
+        if (tom_log_path(tomi, de->d_name, TOM_PART_INDEX, path,
+                         sizeof(path)) != TOM_OK || stat(path, &st) == 0)
+            continue;
+        if (part_load(tomi, de->d_name) == TOM_OK)
+            part_seal(tomi, de->d_name);
+        part_clear(tomi->part);
+    }
+    closedir(dh);
+}
+
+/*
+ * set up partitioned logs, only called with TOM_LOG_DAY / TOM_LOG_HOUR.
+ * has to happen before the state is loaded, as it changes where the
+ * host logs are. this is the only place logs are read back, so it is
+ * all done before capture starts.
+ */
+int
+part_init(struct tom *tomi)
+{
+    struct timeval now;
+
+    tomi->part = calloc(1, sizeof(struct part_table));
+    if (!tomi->part)
+        err(1, NULL);
+
+    gettimeofday(&now, NULL);
+    part_name(tomi, now.tv_sec, tomi->partition, sizeof(tomi->partition));
+    if (tom_log_mkdir(tomi, tomi->partition) != TOM_OK)
+        return TOM_FAIL;
+
+    part_seal_old(tomi);
+
+    /* restarting part way through, pick up the totals so far */
+    part_load(tomi, tomi->partition);
+    return TOM_OK;
+}
+
+void
+part_free(struct tom *tomi)
+{
+    if (!tomi->part)
+        return;
+    part_clear(tomi->part);
+    free(tomi->part);
+    tomi->part = NULL;
+}
+
+/*
+ * move on to a new partition if its time. everything pending is written
+ * into the old one first, so it is complete when it gets sealed.
+ */
+int
+part_housekeep(struct tom *tomi)
+{
+    struct part_table *pt = tomi->part;
+    struct timeval now;
+    struct host *h;
+    char name[sizeof(tomi->partition)];
+
+    if (!pt)
+        return TOM_OK;
+
+    /*
+     * names sort in time order. if the clock goes back, stay where we
+     * are rather than reopen (and reread) a partition already sealed.
+     */
+    gettimeofday(&now, NULL);
+    part_name(tomi, now.tv_sec, name, sizeof(name));
+    if (strcmp(name, tomi->partition) <= 0)
+        return TOM_OK;
+
+    host_flush(tomi);
+    target_housekeep(tomi, 1);
+    flow_housekeep(tomi, 1);
+    part_seal(tomi, tomi->partition);
+
+    part_clear(pt);
+    strlcpy(tomi->partition, name, sizeof(tomi->partition));
+    tom_log_mkdir(tomi, tomi->partition);
+
+    /* fresh files, so compressed logs start again with a new block */
+    for (h = tomi->hosts; h; h = h->next)
+        h->tz.open = 0;
+
+    return TOM_OK;
+}
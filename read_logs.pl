@@ -8,6 +8,17 @@ if ($argc <= 0) {
 }
 my $log_dir = $ARGV[0];
 
+# a sealed partition (-P) already has the totals in its index
+if (open(INDEX, "<$log_dir/.index")) {
+    while (<INDEX>) {
+        if (my ($ip, $out, $in) = ($_ =~ /(\S+)\s+(\d+)\s+(\d+)/)) {
+            printf("$log_dir/$ip: %.2f MB out, %.2f MB in\n",
+                   ($out / 1024 / 1024), ($in / 1024 / 1024));
+        }
+    }
+    exit;
+}
+
 my @FILES = <$log_dir/*>;
 
 map { &parse($_); } @FILES;
@@ -16,8 +27,12 @@ map { &parse($_); } @FILES;
 sub parse ()
 {
     my $fname = $_[0];
+
+    # compressed (-z) logs go through tomdump, their indexes are skipped
+    return if ($fname =~ /\.tzi$/);
+    my $src = ($fname =~ /\.tz$/) ? "tomdump '$fname' |" : "<$fname";
     
-    if (!open(FILE, "<$fname")) {
+    if (!open(FILE, $src)) {
         print "failed to open $fname\n";
         return;
     }
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2012 Joshua Sandbrook.  All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * host table snapshots. every TOM_STATETIME seconds the host table is
+ * dumped into log_dir/TOM_STATE_FILE, written to a temp file first and
+ * renamed over the old one so a crash never leaves a half written
+ * snapshot behind. tom_init() maps it back in at startup.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tom.h"
+
+#define TOM_STATE_MAGIC   0x544f4d53  /* "TOMS" */
+#define TOM_STATE_VERSION 2     /* 2: 64 bit tx/rx */
+
+/* snapshot file is one header followed by header.count host records */
+struct state_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t saved;         /* epoch time the snapshot was written */
+    uint32_t count;         /* number of host records */
+};
+
+struct state_host {
+    uint8_t  addr[TOM_ADDR_SIZE];
+    uint8_t  mask;
+    uint8_t  type;
+    uint8_t  pad[2];
+    uint32_t last_traffic;
+    uint32_t last_logged;
+    uint32_t pad2;          /* keeps tx/rx 8 byte aligned */
+    uint64_t tx;
+    uint64_t rx;
+};
+
+/*
+ * epoch of the last record in a host log, or 0 if there isnt one. only
+ * the tail of the file is read: the last block of a compressed log, or
+ * the last line of a plain one.
+ */
+static uint32_t
+state_last_record(const char *path, int tz)
+{
+    struct tz_reader r;
+    uint32_t epoch;
+    uint32_t last = 0;
+    uint64_t tx;
+    uint64_t rx;
+    unsigned long long ltx;
+    unsigned long long lrx;
+    char line[128];
+    FILE *fh;
+    int partial;
+
+    if (tz) {
+        if (tz_open(&r, path, UINT32_MAX) == -1)
+            return 0;
+        while (tz_next(&r, &epoch, &tx, &rx) == 1)
+            last = epoch;
+        tz_close(&r);
+        return last;
+    }
+
+    if (!(fh = fopen(path, "r")))
+        return 0;
+    /*
+     * a line is well under half of line, so after skipping the partial
+     * one this always gets a whole one.
+     */
+    partial = fseek(fh, -(long)sizeof(line), SEEK_END) == 0;
+    if (!partial)
+        rewind(fh);
+    while (fgets(line, sizeof(line), fh)) {
+        if (partial) {
+            partial = 0;
+            continue;
+        }
+        if (sscanf(line, "%u %llu %llu", &epoch, &ltx, &lrx) == 3)
+            last = epoch;
+    }
+    fclose(fh);
+    return last;
+}
+
+/* write a snapshot of the host table */
+int
+tom_state_save(struct tom *tomi)
+{
+    char path[256];
+    char tmppath[256];
+    FILE *fh;
+    struct timeval now;
+    struct state_header hdr;
+    struct state_host rec;
+    struct host *h;
+
+    if (tom_log_path(tomi, NULL, TOM_STATE_FILE, path,
+                     sizeof(path)) != TOM_OK ||
+        tom_log_path(tomi, NULL, TOM_STATE_FILE ".tmp", tmppath,
+                     sizeof(tmppath)) != TOM_OK)
+        return TOM_FAIL;
+
+    fh = fopen(tmppath, "w");
+    if (!fh) {
+        syslog(LOG_ERR, "Could not open %s for writing", tmppath);
+        return TOM_FAIL;
+    }
+
+    gettimeofday(&now, NULL);
+    hdr.magic = TOM_STATE_MAGIC;
+    hdr.version = TOM_STATE_VERSION;
+    hdr.saved = now.tv_sec;
+    hdr.count = 0;
+    for (h = tomi->hosts; h; h = h->next)
+        hdr.count++;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fh) != 1)
+        goto fail;
+
+    memset(&rec, 0, sizeof(rec));
+    for (h = tomi->hosts; h; h = h->next) {
+        memcpy(rec.addr, h->ip.addr, TOM_ADDR_SIZE);
+        rec.mask = h->ip.mask;
+        rec.type = h->ip.type;
+        rec.last_traffic = h->last_traffic;
+        rec.last_logged = h->last_logged;
+        rec.tx = h->tx;
+        rec.rx = h->rx;
+        if (fwrite(&rec, sizeof(rec), 1, fh) != 1)
+            goto fail;
+    }
+
+    /* make sure its all on disk before it replaces the old snapshot */
+    if (fflush(fh) != 0 || fsync(fileno(fh)) == -1)
+        goto fail;
+    if (fclose(fh) != 0) {
+        fh = NULL;
+        goto fail;
+    }
+    fh = NULL;
+
+    if (rename(tmppath, path) == -1)
+        goto fail;
+
+    return TOM_OK;
+
+fail:
+    syslog(LOG_ERR, "Failed to write state to %s: %m", tmppath);
+    if (fh)
+        fclose(fh);
+    unlink(tmppath);
+    return TOM_FAIL;
+}
+
+/*
+ * restore the host table from the last snapshot, if there is one.
+ * a host whose log file was written after the snapshot already has its
+ * counters on disk, so only its timestamps are restored - otherwise the
+ * same bytes would be logged twice after a crash.
+ */
+int
+tom_state_load(struct tom *tomi)
+{
+    char path[256];
+    char logpath[256];
+    int fd;
+    struct stat st;
+    void *map;
+    struct state_header *hdr;
+    struct state_host *rec;
+    struct host *h;
+    uint32_t x;
+    uint32_t last;
+
+    if (tom_log_path(tomi, NULL, TOM_STATE_FILE, path,
+                     sizeof(path)) != TOM_OK)
+        return TOM_FAIL;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            return TOM_OK;
+        syslog(LOG_ERR, "Could not open %s: %m", path);
+        return TOM_FAIL;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(*hdr)) {
+        syslog(LOG_ERR, "Ignoring invalid state file %s", path);
+        close(fd);
+        return TOM_FAIL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "Could not map %s: %m", path);
+        return TOM_FAIL;
+    }
+
+    hdr = map;
+    if (hdr->magic != TOM_STATE_MAGIC || hdr->version != TOM_STATE_VERSION ||
+        st.st_size != (off_t)(sizeof(*hdr) + hdr->count * sizeof(*rec))) {
+        syslog(LOG_ERR, "Ignoring invalid state file %s", path);
+        munmap(map, st.st_size);
+        return TOM_FAIL;
+    }
+
+    rec = (struct state_host *)(hdr + 1);
+    for (x = 0; x < hdr->count; x++, rec++) {
+        if (rec->type != TOM_IP4 && rec->type != TOM_IP6)
+            continue;
+
+        h = host_alloc();
+        memcpy(h->ip.addr, rec->addr, TOM_ADDR_SIZE);
+        h->ip.mask = rec->mask;
+        h->ip.type = rec->type;
+        h->last_traffic = rec->last_traffic;
+        h->last_logged = rec->last_logged;
+        h->tx = rec->tx;
+        h->rx = rec->rx;
+
+        /*
+         * a record is stamped with the last_logged it was written at, so
+         * if the log has one from our last_logged on, the counts saved
+         * here were written after the snapshot.
+         */
+        if ((h->tx || h->rx) &&
+            host_log_path(tomi, h, logpath, sizeof(logpath)) == TOM_OK &&
+            (last = state_last_record(logpath, tomi->log_flags & TOM_LOG_TZ)) &&
+            last >= h->last_logged) {
+            h->tx = 0;
+            h->rx = 0;
+        }
+
+        h->next = tomi->hosts;
+        tomi->hosts = h;
+        tomi->hosts_size++;
+    }
+
+    syslog(LOG_INFO, "restored %u hosts from %s", hdr->count, path);
+    munmap(map, st.st_size);
+    return TOM_OK;
+}
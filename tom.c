@@ -14,32 +14,150 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <arpa/inet.h>
 #include <syslog.h>
 #include <pcap.h>
 #include <string.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "tom.h"
 #include "string.h"
 
+/* build log_dir/<sub>/<name> into buff. sub may be NULL */
 int
-host_log(struct tom *tomi, struct host *h)
+tom_log_path(struct tom *tomi, const char *sub, const char *name,
+             char *buff, size_t buff_size)
+{
+    if (strlcpy(buff, tomi->log_dir, buff_size) >= buff_size ||
+        (sub && (strlcat(buff, "/", buff_size) >= buff_size ||
+                 strlcat(buff, sub, buff_size) >= buff_size)) ||
+        (name && (strlcat(buff, "/", buff_size) >= buff_size ||
+                  strlcat(buff, name, buff_size) >= buff_size))) {
+        syslog(LOG_ERR, "log path too long");
+        return TOM_FAIL;
+    }
+    return TOM_OK;
+}
+
+/* make sure log_dir/<sub> exists, we may have been started on a fresh dir */
+int
+tom_log_mkdir(struct tom *tomi, const char *sub)
 {
     char path[256];
+
+    if (tom_log_path(tomi, sub, NULL, path, sizeof(path)) != TOM_OK)
+        return TOM_FAIL;
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        syslog(LOG_ERR, "Could not create %s: %m", path);
+        return TOM_FAIL;
+    }
+    return TOM_OK;
+}
+
+/*
+ * subdirectory for the subnet/flow/service logs: kind, or
+ * <partition>/kind when the logs are partitioned. may use buff.
+ */
+const char *
+tom_log_sub(struct tom *tomi, const char *kind, char *buff, size_t buff_size)
+{
+    if (!tomi->part)
+        return kind;
+    snprintf(buff, buff_size, "%s/%s", tomi->partition, kind);
+    return buff;
+}
+
+/* build the path of the log file for the given host into buff */
+int
+host_log_path(struct tom *tomi, struct host *h, char *buff, size_t buff_size)
+{
     char ip[64];
+
+    ip_str(&h->ip, ip, sizeof(ip));
+    if (tomi->log_flags & TOM_LOG_TZ)
+        strlcat(ip, TZ_SUFFIX, sizeof(ip));
+    return tom_log_path(tomi, tomi->part ? tomi->partition : NULL, ip,
+                        buff, buff_size);
+}
+
+/*
+ * format the log record for h into buff, returns its length or -1.
+ * compressed records are relative to the last one, so if this one then
+ * doesnt make it to disk h->tz.open has to be cleared.
+ */
+int
+host_log_record(struct tom *tomi, struct host *h, char *buff, size_t buff_size)
+{
+    int len;
+
+    if (tomi->log_flags & TOM_LOG_TZ)
+        return tz_encode(&h->tz, h->last_logged, h->tx, h->rx,
+                         (uint8_t *)buff, buff_size);
+
+    /* output is: <epoch> <tx bytes> <rx bytes>\n */
+    len = snprintf(buff, buff_size, "%u %llu %llu\n", h->last_logged,
+                   (unsigned long long)h->tx, (unsigned long long)h->rx);
+    if (len < 0 || (size_t)len >= buff_size)
+        return -1;
+    return len;
+}
+
+/*
+ * compressed logs carry on from the last record written, so if we lost
+ * track of where this host's log was (new host struct, restart, failed
+ * write) pick it up from the file rather than starting a new block.
+ */
+static void
+host_log_resume(struct tom *tomi, struct host *h)
+{
+    char path[256];
+
+    if (!(tomi->log_flags & TOM_LOG_TZ) || h->tz.open)
+        return;
+    if (host_log_path(tomi, h, path, sizeof(path)) == TOM_OK)
+        tz_resume(&h->tz, path);
+}
+
+/* note a new compressed block at offset in <path>i */
+static void
+host_log_index(const char *path, uint32_t epoch, long offset)
+{
+    char ipath[260];
+    uint8_t entry[8];
+    FILE *fh;
+
+    snprintf(ipath, sizeof(ipath), "%s%s", path, TZ_INDEX);
+    tz_index_entry(epoch, offset, entry);
+    fh = fopen(ipath, "a");
+    if (!fh || fwrite(entry, sizeof(entry), 1, fh) != 1)
+        syslog(LOG_ERR, "Failed to write to %s", ipath);
+    if (fh)
+        fclose(fh);
+}
+
+int
+host_log(struct tom *tomi, struct host *h)
+{
+    char path[256];
+    char record[TOM_LOG_RECORD];
+    int len;
+    int block = 0;
+    long offset = 0;
     FILE *fh;
     struct timeval now;
 
-    ip_str(&h->ip, ip, sizeof(ip));
-    if (strlcpy(path, tomi->log_dir, sizeof(path)) >= sizeof(path) ||
-        strlcat(path, "/", sizeof(path)) >= sizeof(path) ||
-        strlcat(path, ip, sizeof(path)) >= sizeof(path)) {
-        syslog(LOG_ERR, "log path too long");
+    host_log_resume(tomi, h);
+    if (host_log_path(tomi, h, path, sizeof(path)) != TOM_OK)
         return TOM_FAIL;
-    }
 
     fh = fopen(path, "a");
     if (!fh) {
@@ -47,20 +165,106 @@ host_log(struct tom *tomi, struct host *h)
         return TOM_FAIL;
     }
 
-    /* output is: <epoch> <tx bytes> <rx bytes>\n */
-    if (fprintf(fh, "%u %u %u\n", h->last_logged, h->tx, h->rx) < 0) {
+    /* a new compressed block needs to go in the index, so where is it */
+    if (tomi->log_flags & TOM_LOG_TZ &&
+        tz_needs_block(&h->tz, h->last_logged)) {
+        block = 1;
+        if (fseek(fh, 0, SEEK_END) == -1 || (offset = ftell(fh)) == -1) {
+            syslog(LOG_ERR, "Could not seek in %s: %m", path);
+            fclose(fh);
+            return TOM_FAIL;
+        }
+    }
+
+    if ((len = host_log_record(tomi, h, record, sizeof(record))) < 0 ||
+        fwrite(record, len, 1, fh) != 1) {
         syslog(LOG_ERR, "Failed to write to %s\n", path);
+        h->tz.open = 0;
         fclose(fh);
         return TOM_FAIL;
     }
-    fclose(fh);
+    if (fclose(fh) == EOF) {
+        syslog(LOG_ERR, "Failed to write to %s\n", path);
+        h->tz.open = 0;
+        return TOM_FAIL;
+    }
+
+    /*
+     * without the entry readers just cant seek to (or resync at) this
+     * block, the data is still fine so it is not worth a retry.
+     */
+    if (block)
+        host_log_index(path, h->last_logged, offset);
     
+    /* counters are now on disk, start counting again from zero */
+    part_account(tomi, &h->ip, h->tx, h->rx);
+    h->tx = 0;
+    h->rx = 0;
+
     gettimeofday(&now, NULL);
     h->last_logged = now.tv_sec;
 
     return TOM_OK;
 }
 
+/*
+ * log every host which has had traffic and hasnt been logged for
+ * TOM_LOGTIME (or all with traffic, if flush is set). with io_uring the
+ * lot goes to the kernel as one batch, otherwise one host_log() each.
+ */
+int
+host_log_due(struct tom *tomi, int flush)
+{
+    struct host *h;
+    struct timeval now;
+    int ret = TOM_OK;
+
+    if (!tomi->logw_tried) {
+        tomi->logw_tried = 1;
+        logw_init(tomi);
+    }
+
+    gettimeofday(&now, NULL);
+    for (h = tomi->hosts; h; h = h->next) {
+        if ((!h->tx && !h->rx) || h->logging)
+            continue;
+        if (!flush && now.tv_sec - h->last_logged <= TOM_LOGTIME)
+            continue;
+        host_log_resume(tomi, h);
+        /*
+         * starting a compressed block needs the file offset for the
+         * index, which is only ~1 in TZ_BLOCK writes, so do those here.
+         */
+        if (tomi->logw && !(tomi->log_flags & TOM_LOG_TZ &&
+                            tz_needs_block(&h->tz, h->last_logged))) {
+            if (logw_queue(tomi, h) != TOM_OK)
+                ret = TOM_FAIL;
+        }
+        else if (host_log(tomi, h) != TOM_OK)
+            ret = TOM_FAIL;
+    }
+
+    if (logw_commit(tomi) != TOM_OK)
+        ret = TOM_FAIL;
+    return ret;
+}
+
+/*
+ * write out any pending data for every host, ie before shutting down.
+ * hosts with a write still in flight are skipped by host_log_due(), and
+ * may have picked up more bytes since, so wait for those first.
+ */
+int
+host_flush(struct tom *tomi)
+{
+    int ret;
+
+    logw_drain(tomi);
+    ret = host_log_due(tomi, 1);
+    logw_drain(tomi);
+    return ret;
+}
+
 /* 
  * go through list of hosts structures and remove them if they have 
  * not sent data for some time.
@@ -74,14 +278,25 @@ host_purge(struct tom *tomi)
     struct timeval now;
     gettimeofday(&now, NULL);
 
+    /* after the targets change, hosts no longer targeted go as well */
+    int retarget = tomi->retarget;
+    tomi->retarget = 0;
+
     prevhost = NULL;
     thishost = tomi->hosts;
     while (thishost) {
         nexthost = thishost->next;
-        if ((now.tv_sec - thishost->last_traffic) > TOM_PURGETIME) {
+        if (thishost->logging) {
+            /* wait for the write to finish before we let go of it */
+            tomi->retarget |= retarget;
+            prevhost = thishost;
+            thishost = nexthost;
+        }
+        else if ((now.tv_sec - thishost->last_traffic) > TOM_PURGETIME ||
+                 (retarget && !target_find(tomi, &thishost->ip))) {
 
             /* if any data pending to write, write it... */
-            if (thishost->tx > 0 || thishost->tx > 0)
+            if (thishost->tx > 0 || thishost->rx > 0)
                 host_log(tomi, thishost);
 
             /* now remove host from list */
@@ -102,6 +317,107 @@ host_purge(struct tom *tomi)
     return TOM_OK;
 }
 
+/* write the running totals of a target subnet to log_dir/subnets/<ip>_<mask> */
+int
+target_log(struct tom *tomi, struct target *t)
+{
+    char path[256];
+    char sub[32];
+    char name[80];
+    FILE *fh;
+    struct timeval now;
+
+    ip_str(&t->ip, name, sizeof(name));
+    snprintf(name + strlen(name), sizeof(name) - strlen(name), "_%u",
+             t->ip.mask);
+    if (tom_log_path(tomi, tom_log_sub(tomi, "subnets", sub, sizeof(sub)),
+                     name, path, sizeof(path)) != TOM_OK)
+        return TOM_FAIL;
+
+    fh = fopen(path, "a");
+    if (!fh) {
+        syslog(LOG_ERR, "Could not open %s for writing", path);
+        return TOM_FAIL;
+    }
+
+    /* same format as the host logs */
+    if (fprintf(fh, "%u %llu %llu\n", t->last_logged,
+                (unsigned long long)t->tx, (unsigned long long)t->rx) < 0) {
+        syslog(LOG_ERR, "Failed to write to %s\n", path);
+        fclose(fh);
+        return TOM_FAIL;
+    }
+    fclose(fh);
+
+    t->tx = 0;
+    t->rx = 0;
+
+    gettimeofday(&now, NULL);
+    t->last_logged = now.tv_sec;
+
+    return TOM_OK;
+}
+
+/*
+ * log the subnet totals on the same schedule as the hosts. if flush is
+ * set, log anything pending straight away.
+ */
+int
+target_housekeep(struct tom *tomi, int flush)
+{
+    struct target *t;
+    struct timeval now;
+    char sub[32];
+    int dir_ok = 0;
+
+    gettimeofday(&now, NULL);
+    for (t = tomi->targets; t; t = t->next) {
+        if (!t->tx && !t->rx) {
+            t->last_logged = now.tv_sec;
+            continue;
+        }
+        if (!flush && now.tv_sec - t->last_logged <= TOM_LOGTIME)
+            continue;
+        if (!dir_ok) {
+            if (tom_log_mkdir(tomi, tom_log_sub(tomi, "subnets", sub,
+                                                sizeof(sub))) != TOM_OK)
+                return TOM_FAIL;
+            dir_ok = 1;
+        }
+        target_log(tomi, t);
+    }
+    return TOM_OK;
+}
+
+/*
+ * periodic jobs which dont need to happen for every packet. purges idle
+ * hosts and snapshots the host table so a restart can pick up from here.
+ */
+int
+tom_housekeep(struct tom *tomi)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    if (now.tv_sec == tomi->last_housekeep)
+        return TOM_OK;
+    tomi->last_housekeep = now.tv_sec;
+
+    logw_poll(tomi);
+    part_housekeep(tomi);
+    host_alert(tomi, now.tv_sec);
+    host_log_due(tomi, 0);
+    host_purge(tomi);
+    target_housekeep(tomi, 0);
+    flow_housekeep(tomi, 0);
+
+    if (now.tv_sec - tomi->last_state >= TOM_STATETIME) {
+        tom_state_save(tomi);
+        tomi->last_state = now.tv_sec;
+    }
+    return TOM_OK;
+}
+
 /* allocate and init a host structure */
 struct host *
 host_alloc() {
@@ -119,11 +435,53 @@ host_alloc() {
     tmphost->last_logged = 0;
     tmphost->tx = 0;
     tmphost->rx = 0;
+    tmphost->logging = 0;
+    memset(&tmphost->tz, 0, sizeof(tmphost->tz));
+    tmphost->rate_sec = 0;
+    tmphost->rate_btx = 0;
+    tmphost->rate_brx = 0;
+    tmphost->rate_tx = 0;
+    tmphost->rate_rx = 0;
+    tmphost->last_alert = 0;
     tmphost->next = NULL;
 
     return tmphost;
 }
 
+/*
+ * move the host's rates on to second sec. each second that has gone by
+ * is folded into the EWMA with weight 1/2^TOM_RATE_SHIFT, the first
+ * with the bytes seen in it and the rest (if the host was idle) with
+ * none. packets with an older timestamp just go in the current second.
+ */
+static void
+host_rate_fold(struct host *h, uint32_t sec)
+{
+    uint32_t idle;
+
+    if (sec <= h->rate_sec)
+        return;
+
+    h->rate_tx += ((h->rate_btx << TOM_RATE_FRAC) >> TOM_RATE_SHIFT) -
+                  (h->rate_tx >> TOM_RATE_SHIFT);
+    h->rate_rx += ((h->rate_brx << TOM_RATE_FRAC) >> TOM_RATE_SHIFT) -
+                  (h->rate_rx >> TOM_RATE_SHIFT);
+    h->rate_btx = 0;
+    h->rate_brx = 0;
+
+    /* after a minute or so of nothing, whatever is left is noise */
+    idle = sec - h->rate_sec - 1;
+    if (idle >= 64) {
+        h->rate_tx = 0;
+        h->rate_rx = 0;
+    }
+    for (; idle && (h->rate_tx || h->rate_rx) && idle < 64; idle--) {
+        h->rate_tx -= h->rate_tx >> TOM_RATE_SHIFT;
+        h->rate_rx -= h->rate_rx >> TOM_RATE_SHIFT;
+    }
+    h->rate_sec = sec;
+}
+
 /* log tx/rx bytes against a targeted host
  * the tx argument specifies weather the given ip is the source (TX)
  * or the dst (RX)
@@ -132,6 +490,7 @@ int
 host_account(struct tom *tomi, 
              struct pcap_pkthdr *header, 
              struct ip_addr *ip,
+             uint64_t bytes,
              int tx)
 {
     /* debug only... */
@@ -139,16 +498,16 @@ host_account(struct tom *tomi,
     ip_str(ip, buff, sizeof(buff));
 
     /* see if ip is in the targeted list */
-    struct ip_addr *tgt;
-    tgt = tomi->targets;
-    while (tgt) {
-        if (ip_same_subnet(ip, tgt))
-            break;
-        tgt = tgt->next;
-    }
+    struct target *tgt;
+    tgt = target_find(tomi, ip);
     if (!tgt)
         return TOM_SKIPPED;
 
+    if (tx)
+        tgt->tx += bytes;
+    else
+        tgt->rx += bytes;
+
     /* now see if we already have an existing host with same ip */
     struct host *ehost;
     ehost = tomi->hosts;
@@ -169,10 +528,16 @@ host_account(struct tom *tomi,
     }
     
     ehost->last_traffic = header->ts.tv_sec;
-    if (tx)
-        ehost->tx += header->caplen;
-    else
-        ehost->rx += header->caplen;
+    if ((uint32_t)header->ts.tv_sec != ehost->rate_sec)
+        host_rate_fold(ehost, header->ts.tv_sec);
+    if (tx) {
+        ehost->tx += bytes;
+        ehost->rate_btx += bytes;
+    }
+    else {
+        ehost->rx += bytes;
+        ehost->rate_brx += bytes;
+    }
 
     /* DEBUG */
     /* printf("(%u) %s %u tx %u rx \n", tomi->hosts_size,  */
@@ -180,38 +545,67 @@ host_account(struct tom *tomi,
     /*        ehost->tx,  */
     /*        ehost->rx); */
 
-    /* does it need logging? */
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    if (now.tv_sec - ehost->last_logged > TOM_LOGTIME)
-        host_log(tomi, ehost);
+    /* logging is done from tom_housekeep(), see host_log_due() */
 
     return TOM_OK;
 }
 
-/* add a new target ip address / subnet to watch. */
-int 
-tom_add_target(struct tom *tomi, struct ip_addr *ip)
+/* find the target subnet ip falls within, or NULL if its not targeted */
+struct target *
+target_find(struct tom *tomi, struct ip_addr *ip)
+{
+    struct target *tgt;
+
+    for (tgt = tomi->targets; tgt; tgt = tgt->next) {
+        if (ip_same_subnet(ip, &tgt->ip))
+            return tgt;
+    }
+    return NULL;
+}
+
+/* allocate and init a target structure, or return NULL if ip is invalid */
+struct target *
+target_alloc(struct ip_addr *ip)
 {
     /* do some sanity checking... */
-    if ((!tomi || !ip) ||
+    if (!ip ||
         (ip->type != TOM_IP4 && ip->type != TOM_IP6) ||
         (ip->type == TOM_IP4 && ip->mask > 24) ||
         (ip->type == TOM_IP6 && ip->mask > 128))
-        return TOM_INVALID;
+        return NULL;
 
-    struct ip_addr *tmp;
-    tmp = malloc(sizeof(struct ip_addr));
+    struct target *tmp;
+    struct timeval now;
+    tmp = malloc(sizeof(struct target));
     if (!tmp) 
         err(1, NULL);
 
-    memcpy(tmp->addr, ip->addr, TOM_ADDR_SIZE);
-    tmp->mask = ip->mask;
-    tmp->type = ip->type;
+    gettimeofday(&now, NULL);
+    memcpy(tmp->ip.addr, ip->addr, TOM_ADDR_SIZE);
+    tmp->ip.mask = ip->mask;
+    tmp->ip.type = ip->type;
+    tmp->ip.next = NULL;
+    tmp->last_logged = now.tv_sec;
+    tmp->tx = 0;
+    tmp->rx = 0;
+    tmp->max_tx = 0;
+    tmp->max_rx = 0;
     tmp->next = NULL;
+
+    return tmp;
+}
+
+/* add a new target ip address / subnet to watch. */
+int 
+tom_add_target(struct tom *tomi, struct ip_addr *ip)
+{
+    struct target *tmp;
+
+    if (!tomi || !(tmp = target_alloc(ip)))
+        return TOM_INVALID;
     
     if (tomi->targets) {
-        struct ip_addr *tmp2;
+        struct target *tmp2;
         tmp2 = tomi->targets;
         while (tmp2) {
             if (!tmp2->next) {
@@ -227,6 +621,207 @@ tom_add_target(struct tom *tomi, struct ip_addr *ip)
     return TOM_OK;
 }
 
+/*
+ * replace the whole targets list with the given ip_addr list, ie when the
+ * targets file is reloaded. the new list is built up on the side and then
+ * swapped in with a single pointer store, so accounting never sees a half
+ * built list. subnets in both lists keep their running totals, ones which
+ * were dropped get logged first. hosts no longer covered are purged on the
+ * next host_purge().
+ */
+int
+tom_set_targets(struct tom *tomi, struct ip_addr *ips)
+{
+    struct target *newlist = NULL;
+    struct target *tail = NULL;
+    struct target *tmp;
+    struct target *old;
+    struct target *next;
+    struct ip_addr *ip;
+    char sub[32];
+
+    for (ip = ips; ip; ip = ip->next) {
+        if (!(tmp = target_alloc(ip)))
+            goto invalid;
+        if (tail)
+            tail->next = tmp;
+        else
+            newlist = tmp;
+        tail = tmp;
+    }
+
+    if (!newlist)
+        return TOM_INVALID;
+
+    /*
+     * carry over the totals of subnets we already had. only the network
+     * bits count, 10.0.0.1/24 is the same subnet as 10.0.0.0/24.
+     */
+    for (tmp = newlist; tmp; tmp = tmp->next) {
+        for (old = tomi->targets; old; old = old->next) {
+            if (old->ip.mask == tmp->ip.mask &&
+                ip_same_subnet(&old->ip, &tmp->ip)) {
+                tmp->last_logged = old->last_logged;
+                tmp->tx = old->tx;
+                tmp->rx = old->rx;
+                old->tx = 0;
+                old->rx = 0;
+                break;
+            }
+        }
+    }
+
+    /* publish. rate limits are set again afterwards, see tom_set_limit() */
+    old = tomi->targets;
+    tomi->targets = newlist;
+    tomi->retarget = 1;
+    tomi->limits = 0;
+
+    /* anything still on the old list is no longer targeted */
+    for (; old; old = next) {
+        next = old->next;
+        if (old->tx || old->rx) {
+            if (tom_log_mkdir(tomi, tom_log_sub(tomi, "subnets", sub,
+                                                sizeof(sub))) == TOM_OK)
+                target_log(tomi, old);
+        }
+        free(old);
+    }
+    return TOM_OK;
+
+invalid:
+    for (tmp = newlist; tmp; tmp = next) {
+        next = tmp->next;
+        free(tmp);
+    }
+    return TOM_INVALID;
+}
+
+/*
+ * set the per host rate limits (bytes/sec, 0 for none) for the target
+ * subnet, which has to be one of the current targets.
+ */
+int
+tom_set_limit(struct tom *tomi, struct ip_addr *subnet, uint32_t max_tx,
+              uint32_t max_rx)
+{
+    struct target *tgt;
+
+    for (tgt = tomi->targets; tgt; tgt = tgt->next) {
+        if (tgt->ip.mask == subnet->mask && ip_same_subnet(&tgt->ip, subnet)) {
+            tgt->max_tx = max_tx;
+            tgt->max_rx = max_rx;
+            if (max_tx || max_rx)
+                tomi->limits = 1;
+            return TOM_OK;
+        }
+    }
+    return TOM_INVALID;
+}
+
+/* program to run as "<path> <ip> <tx B/s> <rx B/s> <subnet>" on alerts */
+void
+tom_set_alert_hook(struct tom *tomi, const char *path)
+{
+    if (tomi->alert_hook)
+        free(tomi->alert_hook);
+    tomi->alert_hook = strdup(path);
+    if (!tomi->alert_hook)
+        err(1, NULL);
+}
+
+/* tell someone host h is over the limits of its subnet t */
+static void
+host_alert_raise(struct tom *tomi, struct host *h, struct target *t,
+                 uint32_t tx, uint32_t rx)
+{
+    char ip[64];
+    char subnet[80];
+    char txs[16];
+    char rxs[16];
+    pid_t pid;
+
+    ip_str(&h->ip, ip, sizeof(ip));
+    ip_str(&t->ip, subnet, sizeof(subnet));
+    snprintf(subnet + strlen(subnet), sizeof(subnet) - strlen(subnet), "/%u",
+             t->ip.mask);
+    snprintf(txs, sizeof(txs), "%u", tx);
+    snprintf(rxs, sizeof(rxs), "%u", rx);
+
+    syslog(LOG_WARNING, "%s over rate limit for %s: tx %s B/s (max %u) "
+           "rx %s B/s (max %u)", ip, subnet, txs, t->max_tx, rxs, t->max_rx);
+
+    if (!tomi->alert_hook)
+        return;
+
+    /* SIGCHLD is ignored, so there is no need to wait for it */
+    pid = fork();
+    if (pid == -1)
+        syslog(LOG_ERR, "fork(): %m, alert hook not run");
+    else if (pid == 0) {
+        /* the hook may well want to wait on children of its own */
+        signal(SIGCHLD, SIG_DFL);
+        execl(tomi->alert_hook, tomi->alert_hook, ip, txs, rxs, subnet,
+              (char *)NULL);
+        _exit(127);
+    }
+}
+
+/*
+ * bring every hosts rates up to now, and alert on those over the limits
+ * of their subnet. a host is alerted on at most once per TOM_ALERTTIME.
+ */
+int
+host_alert(struct tom *tomi, uint32_t now)
+{
+    struct host *h;
+    struct target *tgt;
+    uint64_t tx;
+    uint64_t rx;
+
+    if (!tomi->limits)
+        return TOM_OK;
+
+    for (h = tomi->hosts; h; h = h->next) {
+        host_rate_fold(h, now);
+        tgt = target_find(tomi, &h->ip);
+        if (!tgt || (!tgt->max_tx && !tgt->max_rx))
+            continue;
+
+        tx = h->rate_tx >> TOM_RATE_FRAC;
+        rx = h->rate_rx >> TOM_RATE_FRAC;
+        if (!(tgt->max_tx && tx > tgt->max_tx) &&
+            !(tgt->max_rx && rx > tgt->max_rx))
+            continue;
+        if (h->last_alert && now - h->last_alert < TOM_ALERTTIME)
+            continue;
+
+        h->last_alert = now;
+        host_alert_raise(tomi, h, tgt, tx > UINT32_MAX ? UINT32_MAX : tx,
+                         rx > UINT32_MAX ? UINT32_MAX : rx);
+    }
+    return TOM_OK;
+}
+
+/* mix 16 bytes (an address, or a flow key) down to 32 bits for hashing */
+uint32_t
+tom_hash16(const void *key)
+{
+    uint32_t w[4];
+    uint32_t h = 0x9e3779b9;
+    int x;
+
+    memcpy(w, key, sizeof(w));
+    for (x=0; x<4; x++) {
+        h ^= w[x];
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+    }
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
 
 /* print ip address into buff */
 void
@@ -296,16 +891,23 @@ ip_same_subnet(struct ip_addr *ip, struct ip_addr *subnet)
 }
 
 
-/* grabs the dst/src addresses. assumes */
+/*
+ * grabs the dst/src addresses, and the ports if its tcp/udp. len is how
+ * much of the packet was captured from the start of the ip header.
+ */
 int
-tom_process_ip4(uint8_t *packet, struct ip_pair *pair)
+tom_process_ip4(uint8_t *packet, uint32_t len, struct ip_pair *pair)
 {
         uint8_t *h = packet;
         uint16_t header_length = 0xf & *h;
 
-        if (header_length < 5 || header_length > 15) 
+        if (header_length < 5 || header_length > 15 || len < 20) 
             return TOM_SKIPPED;
 
+        pair->proto = packet[9];
+        pair->sport = 0;
+        pair->dport = 0;
+
         h += 12;
 
         /* store src/dst IP addresses */
@@ -318,9 +920,37 @@ tom_process_ip4(uint8_t *packet, struct ip_pair *pair)
         pair->dst.type = TOM_IP4;
         pair->dst.mask = 32;
 
+        /* ports are only in the first fragment */
+        if ((pair->proto == IPPROTO_TCP || pair->proto == IPPROTO_UDP) &&
+            (ntohs(*(uint16_t *)(packet + 6)) & 0x1fff) == 0 &&
+            len >= (uint32_t)header_length * 4 + 4) {
+            h = packet + header_length * 4;
+            pair->sport = (h[0] << 8) | h[1];
+            pair->dport = (h[2] << 8) | h[3];
+        }
+
         return TOM_OK;
 }
 
+/* 
+ * account bytes between the pair of addresses, against which ever ends
+ * are targeted. shared by packet capture (bytes is the caplen) and the
+ * flow collector, where one record can be well over 4GB.
+ */
+int
+tom_account(struct tom *tomi, struct pcap_pkthdr *header, struct ip_pair *pair,
+            uint64_t bytes)
+{
+    if (host_account(tomi, header, &pair->src, bytes, 1) == TOM_OK &&
+        tomi->flows)
+        flow_account(tomi, header, pair, bytes, 1);
+    if (host_account(tomi, header, &pair->dst, bytes, 0) == TOM_OK &&
+        tomi->flows)
+        flow_account(tomi, header, pair, bytes, 0);
+
+    return TOM_OK;
+}
+
 /* process a single packet */
 int
 tom_process(struct tom *tomi, struct pcap_pkthdr *header, const uint8_t *packet)
@@ -348,13 +978,17 @@ tom_process(struct tom *tomi, struct pcap_pkthdr *header, const uint8_t *packet)
     /* skip past ether type / size field */
     pp += 2;
 
+    if (header->caplen <= (uint32_t)(pp - packet))
+        return TOM_SKIPPED;
+
     /* go grab the src/dst addresses */
     struct ip_pair pair;
     int ret = TOM_FAIL;
+    memset(&pair, 0, sizeof(pair));
     switch (*pp >> 4) {
     case 4: 
         /* IPV4 */
-        ret = tom_process_ip4(pp, &pair);
+        ret = tom_process_ip4(pp, header->caplen - (pp - packet), &pair);
         break;
     default:
         return TOM_SKIPPED;
@@ -365,60 +999,84 @@ tom_process(struct tom *tomi, struct pcap_pkthdr *header, const uint8_t *packet)
         return ret;
 
     /* now do some accounting... */
-    host_account(tomi, header, &pair.src, 1);
-    host_account(tomi, header, &pair.dst, 0);
+    return tom_account(tomi, header, &pair, header->caplen);
+}
 
-    return TOM_OK;
+/* pcap_dispatch() callback, hands each packet to tom_process() */
+static void
+tom_dispatch(u_char *user, const struct pcap_pkthdr *hdr, const u_char *packet)
+{
+    tom_process((struct tom *)user, (struct pcap_pkthdr *)hdr, packet);
 }
 
-/* capture and process a single packet, and return. */
+/*
+ * wait up to TOM_READ_TIMEOUT for any of the interfaces to have packets,
+ * and process everything they have ready. an interface which errors is
+ * dropped, we only give up once there are none left.
+ */
 int
-tom_capture_one(struct tom *tomi)
+tom_capture(struct tom *tomi)
 {
-    struct pcap_pkthdr *hdr;
-    const uint8_t      *packet;
+    struct epoll_event events[TOM_MAX_IFACES];
+    struct iface *ifc;
+    int nev;
+    int x;
     int ret;
 
-    ret = pcap_next_ex(tomi->pcap_handle,
-                       &hdr,
-                       &packet);
-    switch (ret) {
-    case 1:  /* packet captured ok */
-        return tom_process(tomi, hdr, packet);
-        break;
-    case 0:  /* timeout */
-        return TOM_TIMEOUT;
-        break;
-    default:
-        syslog(LOG_ERR, "%s", pcap_geterr(tomi->pcap_handle));
-        tom_free(tomi);
+    nev = epoll_wait(tomi->epoll_fd, events, TOM_MAX_IFACES, TOM_READ_TIMEOUT);
+    if (nev == -1) {
+        if (errno == EINTR)
+            return TOM_TIMEOUT;  /* signal, let the caller look at it */
+        syslog(LOG_ERR, "epoll_wait(): %m");
         return TOM_FAIL;
     }
-    return TOM_FAIL;
+    if (nev == 0)
+        return TOM_TIMEOUT;
+
+    for (x=0; x<nev; x++) {
+        ifc = events[x].data.ptr;
+        /* nf_read() returns TOM_* codes, make a failure look like pcap's */
+        if (ifc->nf)
+            ret = nf_read(tomi, ifc) == TOM_FAIL ? -1 : 0;
+        else
+            ret = pcap_dispatch(ifc->pcap_handle, -1, tom_dispatch,
+                                (u_char *)tomi);
+        if (ret == PCAP_ERROR_BREAK)
+            return TOM_STOPPED;
+        if (ret < 0) {
+            syslog(LOG_ERR, "%s: %s, no longer capturing on it", ifc->name,
+                   ifc->nf ? "read failed" : pcap_geterr(ifc->pcap_handle));
+            iface_remove(tomi, ifc);
+            if (!tomi->ifaces)
+                return TOM_FAIL;
+        }
+    }
+    return TOM_OK;
 }
 
 /* free memory and close handles */
 void
 tom_free(struct tom *tomi)
 {
-    if (tomi->interface_name) {
-        free(tomi->interface_name);
-        tomi->interface_name = NULL;
-    }
-    
-    if (tomi->pcap_handle) {
-        pcap_close(tomi->pcap_handle);
-        tomi->pcap_handle = NULL;
+    /* let any log writes in flight finish before the hosts go */
+    logw_free(tomi);
+
+    while (tomi->ifaces)
+        iface_remove(tomi, tomi->ifaces);
+
+    if (tomi->epoll_fd != -1) {
+        close(tomi->epoll_fd);
+        tomi->epoll_fd = -1;
     }
 
     /* free up the targets linked list */
-    struct ip_addr *ip;
-    struct ip_addr *next;
-    ip = tomi->targets;
-    while (ip) {
-        next = ip->next;
-        free(ip);
-        ip = next;
+    struct target *tgt;
+    struct target *next;
+    tgt = tomi->targets;
+    while (tgt) {
+        next = tgt->next;
+        free(tgt);
+        tgt = next;
     }
     tomi->targets = NULL;
     
@@ -434,6 +1092,13 @@ tom_free(struct tom *tomi)
     }
     tomi->hosts = NULL;
 
+    flow_free(tomi);
+    part_free(tomi);
+
+    if (tomi->alert_hook)
+        free(tomi->alert_hook);
+    tomi->alert_hook = NULL;
+
     if (tomi->log_dir)
         free(tomi->log_dir);
     tomi->log_dir = NULL;
@@ -441,47 +1106,178 @@ tom_free(struct tom *tomi)
 
 }
 
-/* opens up a pcap session and gets shit ready */
+/* allocate and init an iface, or NULL if we already have too many */
+struct iface *
+iface_alloc(struct tom *tomi, const char *name)
+{
+    struct iface *ifc;
+    int count = 0;
+
+    for (ifc = tomi->ifaces; ifc; ifc = ifc->next)
+        count++;
+    if (count >= TOM_MAX_IFACES) {
+        warnx("too many interfaces, max is %d", TOM_MAX_IFACES);
+        return NULL;
+    }
+
+    ifc = malloc(sizeof(struct iface));
+    if (!ifc)
+        err(1, NULL);
+    ifc->pcap_handle = NULL;
+    ifc->nf = NULL;
+    ifc->fd = -1;
+    ifc->next = NULL;
+    ifc->name = strdup(name);
+    if (!ifc->name)
+        err(1, NULL);
+
+    return ifc;
+}
+
+/* stop capturing on an interface, and free it */
+void
+iface_remove(struct tom *tomi, struct iface *ifc)
+{
+    struct iface **pp;
+
+    for (pp = &tomi->ifaces; *pp; pp = &(*pp)->next) {
+        if (*pp == ifc) {
+            *pp = ifc->next;
+            break;
+        }
+    }
+    if (ifc->fd != -1)
+        epoll_ctl(tomi->epoll_fd, EPOLL_CTL_DEL, ifc->fd, NULL);
+    if (ifc->pcap_handle)
+        pcap_close(ifc->pcap_handle);
+    else if (ifc->fd != -1)
+        close(ifc->fd);
+    nf_free(ifc);
+    free(ifc->name);
+    free(ifc);
+}
+
+/* add ifc (with its fd set up) to the epoll set and the list of ifaces */
 int
-tom_init(struct tom *tomi, char *iface_name, const char *log_dir)
+iface_attach(struct tom *tomi, struct iface *ifc)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = ifc;
+    if (epoll_ctl(tomi->epoll_fd, EPOLL_CTL_ADD, ifc->fd, &ev) == -1) {
+        syslog(LOG_EMERG, "epoll_ctl(): %m");
+        warn("epoll_ctl()");
+        return TOM_FAIL;
+    }
+
+    ifc->next = tomi->ifaces;
+    tomi->ifaces = ifc;
+
+    return TOM_OK;
+}
+
+/*
+ * open up a pcap session on an interface, in non-blocking mode, and add
+ * it to the set tom_capture() waits on. all interfaces feed the same
+ * host table.
+ */
+int
+tom_add_interface(struct tom *tomi, const char *iface_name)
+{
+    struct iface *ifc;
+
+    if (!tomi || !iface_name)
+        return TOM_INVALID;
+
+    if (!(ifc = iface_alloc(tomi, iface_name)))
+        return TOM_INVALID;
+
+    /* open the pcap device */
+    ifc->pcap_handle = pcap_open_live(ifc->name,
+                                      TOM_CAPLEN,
+                                      1, /* promiscuous mode */
+                                      TOM_READ_TIMEOUT,
+                                      tomi->ebuff);
+    /* any luck? */
+    if (!ifc->pcap_handle) {
+        syslog(LOG_EMERG, "%s", tomi->ebuff);
+        warn("%s", tomi->ebuff);
+        iface_remove(tomi, ifc);
+        return TOM_FAIL;
+    }
+
+    /* TODO: set pcap filter here. */
+
+    if (pcap_setnonblock(ifc->pcap_handle, 1, tomi->ebuff) == -1 ||
+        (ifc->fd = pcap_get_selectable_fd(ifc->pcap_handle)) == -1) {
+        syslog(LOG_EMERG, "%s: can't poll for packets", ifc->name);
+        warnx("%s: can't poll for packets", ifc->name);
+        iface_remove(tomi, ifc);
+        return TOM_FAIL;
+    }
+
+    /* dont hand the capture socket on to alert hooks */
+    if (fcntl(ifc->fd, F_SETFD, FD_CLOEXEC) == -1)
+        syslog(LOG_ERR, "%s: fcntl(FD_CLOEXEC): %m", ifc->name);
+
+    if (iface_attach(tomi, ifc) != TOM_OK) {
+        iface_remove(tomi, ifc);
+        return TOM_FAIL;
+    }
+
+    return TOM_OK;
+}
+
+/* gets shit ready. interfaces are added with tom_add_interface() */
+int
+tom_init(struct tom *tomi, const char *log_dir, int log_flags)
 {
     if (!tomi) 
         return TOM_INVALID;
 
     /* set things to NULL/defaults */
-    tomi->pcap_handle = NULL;
-    tomi->interface_name = NULL;
+    tomi->ifaces = NULL;
+    tomi->epoll_fd = -1;
     tomi->ebuff[0] = '\0';
     tomi->targets = NULL;
     tomi->hosts = NULL;
     tomi->hosts_size = 0;
-    tomi->interface_name = NULL;
     tomi->log_dir = NULL;
-
-    tomi->interface_name = strdup(iface_name);
-    if (!tomi->interface_name)
-        err(1, NULL);
+    tomi->last_housekeep = 0;
+    tomi->last_state = 0;
+    tomi->flows = NULL;
+    tomi->retarget = 0;
+    tomi->logw = NULL;
+    tomi->logw_tried = 0;
+    tomi->log_flags = log_flags;
+    tomi->partition[0] = '\0';
+    tomi->part = NULL;
+    tomi->alert_hook = NULL;
+    tomi->limits = 0;
 
     tomi->log_dir = strdup(log_dir);
     if (!tomi->log_dir)
         err(1, NULL);
 
-    /* open the pcap device */
-    tomi->pcap_handle = pcap_open_live(tomi->interface_name,
-                                       TOM_CAPLEN,
-                                       1, /* promiscuous mode */
-                                       0, /* no timeout */
-                                       tomi->ebuff);
-    /* any luck? */
-    if (!tomi->pcap_handle) {
-        syslog(LOG_EMERG, "%s", tomi->ebuff);
-        warn("%s", tomi->ebuff);
+    tomi->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (tomi->epoll_fd == -1) {
+        syslog(LOG_EMERG, "epoll_create1(): %m");
+        warn("epoll_create1()");
         tom_free(tomi);
         return TOM_FAIL;
     }
 
-    /* TODO: set pcap filter here. */
+    /* before the state, as it decides where the host logs are */
+    if (log_flags & (TOM_LOG_DAY | TOM_LOG_HOUR) &&
+        part_init(tomi) != TOM_OK) {
+        tom_free(tomi);
+        return TOM_FAIL;
+    }
+
+    /* pick up where the last run left off */
+    tom_state_load(tomi);
 
     return TOM_OK;
 }
-
@@ -20,6 +20,8 @@
 #include <pcap.h>
 #include <stdint.h>
 
+#include "tz.h"
+
 /* wee enum for error / return values */
 enum {
     TOM_OK = 0,                 /* no problems */
@@ -28,12 +30,34 @@ enum {
     TOM_TIMEOUT,                /* timeout */
     TOM_SKIPPED,                /* ignored a boring or invalid packet */
     TOM_IP4,                    /* is an IP version 4 packet */
-    TOM_IP6                     /* is an IP version 6 packet */
+    TOM_IP6,                    /* is an IP version 6 packet */
+    TOM_STOPPED                 /* capture was interrupted, ie by a signal */
 };
 
 #define TOM_CAPLEN    65536     /* max packet capture size */
+#define TOM_MAX_IFACES 16       /* max interfaces + flow collectors */
+#define TOM_NF_BATCH  32        /* flow datagrams read per recvmmsg() */
+#define TOM_NF_BUFSIZE 9216     /* max flow datagram size */
+#define TOM_NF_TEMPLATES 256    /* v9/ipfix templates remembered per collector */
 #define TOM_PURGETIME 10        /* time till expiry of inactive hosts  */
 #define TOM_LOGTIME   5        /* time till log should be written  */
+#define TOM_STATETIME 60        /* time between host table snapshots */
+#define TOM_READ_TIMEOUT 1000   /* pcap read timeout (ms), so we still tick */
+#define TOM_FLOWTIME  120       /* time till expiry of idle flows */
+#define TOM_FLOW_SLOTS 65536    /* flow table size (power of 2), 40b each */
+#define TOM_LOGW_SLOTS 1024     /* max host log writes per io_uring batch */
+#define TOM_LOG_RECORD 64       /* max size of a single host log record */
+#define TOM_STATE_FILE ".tom.state" /* snapshot file, kept in the log dir */
+#define TOM_RATE_SHIFT 2        /* weight of each new second in the rates, 1/4 */
+#define TOM_RATE_FRAC 8         /* fractional bits of the fixed point rates */
+#define TOM_ALERTTIME 60        /* min time between rate alerts for a host */
+
+/* log options, for tom_init() */
+#define TOM_LOG_TZ    0x01      /* compressed host logs, see tz.c */
+#define TOM_LOG_DAY   0x02      /* host logs partitioned by day, see partition.c */
+#define TOM_LOG_HOUR  0x04      /* or by hour */
+#define TOM_PART_BUCKETS 65536  /* partition totals hash size (power of 2) */
+#define TOM_PART_INDEX ".index" /* per partition host totals */
 /* #define TOM_PURGETIME 60        /\* time till expiry of inactive hosts  *\/ */
 /* #define TOM_LOGTIME   30        /\* time till log should be written  *\/ */
 
@@ -52,37 +76,143 @@ struct host {
     struct ip_addr ip;
     uint32_t       last_traffic; /* epoch time of last tx/rx */
     uint32_t       last_logged; /* epoch time of last log wirte */
-    uint32_t       tx;
-    uint32_t       rx;
+    uint64_t       tx;           /* 64 bit, flow records can be > 4GB */
+    uint64_t       rx;
+    int            logging;      /* log write in flight, see logwrite.c */
+    struct tz_state tz;          /* where the compressed log is up to */
+    uint32_t       rate_sec;     /* second rate_btx/rate_brx are for */
+    uint64_t       rate_btx;     /* bytes seen so far in rate_sec */
+    uint64_t       rate_brx;
+    uint64_t       rate_tx;      /* EWMA bytes/sec << TOM_RATE_FRAC */
+    uint64_t       rate_rx;
+    uint32_t       last_alert;   /* epoch time of last rate alert */
     struct host   *next;
 };
 
+/* a targeted subnet, with running totals for everything inside it */
+struct target {
+    struct ip_addr ip;
+    uint32_t       last_logged; /* epoch time of last log write */
+    uint64_t       tx;          /* 64 bit, a busy subnet can wrap 32 in one log */
+    uint64_t       rx;
+    uint32_t       max_tx;      /* per host rate limits, bytes/sec, 0 for none */
+    uint32_t       max_rx;
+    struct target *next;
+};
+
+/* io_uring log writer, see logwrite.c */
+struct logw;
+
+/* flow table, only allocated in flow mode. see flow.c */
+struct flow_table;
+
+/* per host totals for the current log partition, see partition.c */
+struct part_table;
+
+/* flow collector state, see netflow.c */
+struct nf_collector;
+
+/* an interface being captured on, or a socket flow records come in on */
+struct iface {
+    pcap_t         *pcap_handle;    /* NULL for a flow collector */
+    struct nf_collector *nf;        /* NULL for a pcap interface */
+    char           *name;
+    int             fd;             /* what we epoll on */
+    struct iface   *next;
+};
+
 /* instance to hold all the shit required for capturing stuff */
 struct tom {
-    pcap_t         *pcap_handle;
-    char           *interface_name;
+    struct iface   *ifaces;
+    int             epoll_fd;       /* waits on all the ifaces */
     char            ebuff[PCAP_ERRBUF_SIZE];
-    struct ip_addr *targets;
+    struct target  *targets;
     struct host    *hosts;
     uint32_t        hosts_size;
     char           *log_dir;
+    uint32_t        last_housekeep; /* epoch time of last housekeeping run */
+    uint32_t        last_state;     /* epoch time of last state snapshot */
+    struct flow_table *flows;       /* NULL unless in flow mode */
+    int             retarget;       /* targets changed, recheck the hosts */
+    struct logw    *logw;           /* NULL if writing logs with stdio */
+    int             logw_tried;     /* only try setting up io_uring once */
+    int             log_flags;      /* TOM_LOG_* */
+    char            partition[16];  /* current log partition, YYYYMMDD[HH] */
+    struct part_table *part;        /* NULL unless partitioned */
+    char           *alert_hook;     /* run on rate alerts, or NULL */
+    int             limits;         /* some target has rate limits set */
 };
 
 
-/* contains src/dst ip addresses. */
+/* contains src/dst ip addresses, and ports for tcp/udp (0 otherwise). */
 struct ip_pair {
     struct ip_addr src;
     struct ip_addr dst;
+    uint8_t        proto;
+    uint16_t       sport;
+    uint16_t       dport;
 };
 
+extern int   flow_account(struct tom *tomi, struct pcap_pkthdr *header,
+                          struct ip_pair *pair, uint64_t bytes, int tx);
+extern void  flow_free(struct tom *tomi);
+extern int   flow_housekeep(struct tom *tomi, int flush);
+extern int   flow_init(struct tom *tomi);
+extern struct host *host_alloc();
+extern int   host_flush(struct tom *tomi);
+extern int   host_log(struct tom *tomi, struct host *h);
+extern int   host_log_due(struct tom *tomi, int flush);
+extern int   host_log_record(struct tom *tomi, struct host *h,
+                             char *buff, size_t buff_size);
+extern int   host_log_path(struct tom *tomi, struct host *h,
+                           char *buff, size_t buff_size);
+extern int   tom_log_path(struct tom *tomi, const char *sub, const char *name,
+                          char *buff, size_t buff_size);
+extern int   tom_log_mkdir(struct tom *tomi, const char *sub);
+extern const char *tom_log_sub(struct tom *tomi, const char *kind,
+                               char *buff, size_t buff_size);
+extern int   host_alert(struct tom *tomi, uint32_t now);
 extern int   host_purge(struct tom *tomi);
+extern struct iface *iface_alloc(struct tom *tomi, const char *name);
+extern int   iface_attach(struct tom *tomi, struct iface *ifc);
+extern void  iface_remove(struct tom *tomi, struct iface *ifc);
+extern int   logw_commit(struct tom *tomi);
+extern void  logw_drain(struct tom *tomi);
+extern void  logw_free(struct tom *tomi);
+extern int   logw_init(struct tom *tomi);
+extern void  logw_poll(struct tom *tomi);
+extern int   logw_queue(struct tom *tomi, struct host *h);
+extern void  part_account(struct tom *tomi, struct ip_addr *ip, uint64_t tx,
+                          uint64_t rx);
+extern void  part_free(struct tom *tomi);
+extern int   part_housekeep(struct tom *tomi);
+extern int   part_init(struct tom *tomi);
+extern void  nf_free(struct iface *ifc);
+extern int   nf_read(struct tom *tomi, struct iface *ifc);
+extern int   tom_housekeep(struct tom *tomi);
+extern int   tom_state_load(struct tom *tomi);
+extern int   tom_state_save(struct tom *tomi);
+extern struct target *target_alloc(struct ip_addr *ip);
+extern struct target *target_find(struct tom *tomi, struct ip_addr *ip);
+extern int   target_housekeep(struct tom *tomi, int flush);
+extern int   target_log(struct tom *tomi, struct target *t);
+extern int   tom_account(struct tom *tomi, struct pcap_pkthdr *header,
+                         struct ip_pair *pair, uint64_t bytes);
+extern int   tom_add_collector(struct tom *tomi, const char *listen);
+extern int   tom_add_interface(struct tom *tomi, const char *iface_name);
 extern int   tom_add_target(struct tom *tomi, struct ip_addr *ip);
+extern int   tom_set_targets(struct tom *tomi, struct ip_addr *ips);
+extern int   tom_set_limit(struct tom *tomi, struct ip_addr *subnet,
+                           uint32_t max_tx, uint32_t max_rx);
+extern void  tom_set_alert_hook(struct tom *tomi, const char *path);
+extern uint32_t tom_hash16(const void *key);
 extern void  ip_str(struct ip_addr *ip, char *buff, size_t buff_size);
 extern int   ip_same(struct ip_addr *a, struct ip_addr *b);
 extern int   ip_same_subnet(struct ip_addr *ip, struct ip_addr *subnet);
-extern int   tom_capture_one(struct tom *tomi);
+extern int   tom_capture(struct tom *tomi);
 extern void  tom_free(struct tom *tomi);
-extern int   tom_init(struct tom *tomi, char *interface_name, const char *log_dir);
+extern int   tom_init(struct tom *tomi, const char *log_dir,
+                      int log_flags);
 
 
 #endif
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2012 Joshua Sandbrook.  All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * print compressed (-z) host logs in the same "<epoch> <tx> <rx>" form
+ * as the plain ones, optionally only between two times.
+ */
+
+#include <sys/types.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "tz.h"
+
+char *progname = NULL;
+
+void
+usage()
+{
+    fprintf(stderr, "usage: %s [-s from] [-e to] logfile.tz ...\n"
+            "from and to are epoch times\n", progname);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct tz_reader r;
+    uint32_t from = 0;
+    uint32_t to = UINT32_MAX;
+    uint32_t epoch;
+    uint64_t tx;
+    uint64_t rx;
+    int oret;
+    int ret = 0;
+    int x;
+
+    progname = argv[0];
+
+    while ((oret = getopt(argc, argv, "s:e:")) != -1) {
+        switch (oret) {
+        case 's':
+            from = strtoul(optarg, NULL, 10);
+            break;
+        case 'e':
+            to = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+            /* NOT REACHED */
+        }
+    }
+    if (optind >= argc)
+        usage();
+
+    for (x=optind; x<argc; x++) {
+        if (tz_open(&r, argv[x], from) == -1) {
+            warn("%s", argv[x]);
+            ret = 1;
+            continue;
+        }
+        while ((oret = tz_next(&r, &epoch, &tx, &rx)) == 1) {
+            /* nothing later can be in range, unless the clock went back */
+            if (epoch > to && r.sorted)
+                break;
+            if (epoch < from || epoch > to)
+                continue;
+            printf("%u %llu %llu\n", epoch, (unsigned long long)tx,
+                   (unsigned long long)rx);
+        }
+        if (r.skipped)
+            warnx("%s: skipped %u corrupt blocks", argv[x], r.skipped);
+        if (oret == -1)
+            warnx("%s: corrupt record", argv[x]);
+        if (oret == -1 || r.skipped)
+            ret = 1;
+        tz_close(&r);
+    }
+    return ret;
+}
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2012 Joshua Sandbrook.  All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * compressed host log encoding. the text log repeats a full epoch and
+ * mostly small counters on every line, this stores the same records as
+ * varints relative to the record before:
+ *
+ *   block header:  varint (TZ_VERSION << 1 | 1), varint epoch
+ *   record:        varint (dt << 1), zigzag varint dtx, zigzag varint drx
+ *
+ * dt is seconds since the previous record (or the block header's
+ * epoch), dtx/drx the change in tx/rx since the previous record (or from
+ * 0). a block is at most TZ_BLOCK records and is self contained, and
+ * every block start is noted in the .tzi index as a little endian
+ * <epoch, offset> pair, so a reader can jump straight to the block
+ * covering a given time.
+ *
+ * the blocks themselves arent framed, so the index is also what gets a
+ * reader past damage (a torn write, say): on a bad record it carries on
+ * from the next block start in the index.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "tz.h"
+
+static size_t
+tz_put(uint8_t *p, uint64_t v)
+{
+    size_t len = 0;
+
+    while (v >= 0x80) {
+        p[len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[len++] = v;
+    return len;
+}
+
+static uint64_t
+tz_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t
+tz_unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* read a varint off fh. returns 1 if ok, 0 on a clean eof, -1 if corrupt */
+static int
+tz_get(FILE *fh, uint64_t *v)
+{
+    int c;
+    int shift = 0;
+
+    *v = 0;
+    while ((c = getc(fh)) != EOF) {
+        if (shift > 63)
+            return -1;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 1;
+        shift += 7;
+    }
+    return shift ? -1 : 0;
+}
+
+/* does the next record at epoch have to start a new block? */
+int
+tz_needs_block(struct tz_state *st, uint32_t epoch)
+{
+    return !st->open || st->count >= TZ_BLOCK || epoch < st->epoch;
+}
+
+/*
+ * encode a record into buff (at least TZ_MAX_RECORD bytes), starting a
+ * new block first if need be, and move st on past it. returns the length.
+ */
+int
+tz_encode(struct tz_state *st, uint32_t epoch, uint64_t tx, uint64_t rx,
+          uint8_t *buff, size_t buff_size)
+{
+    size_t len = 0;
+
+    if (buff_size < TZ_MAX_RECORD)
+        return -1;
+
+    if (tz_needs_block(st, epoch)) {
+        len += tz_put(buff + len, (TZ_VERSION << 1) | 1);
+        len += tz_put(buff + len, epoch);
+        st->epoch = epoch;
+        st->tx = 0;
+        st->rx = 0;
+        st->count = 0;
+        st->open = 1;
+    }
+
+    len += tz_put(buff + len, (uint64_t)(epoch - st->epoch) << 1);
+    len += tz_put(buff + len, tz_zigzag((int64_t)(tx - st->tx)));
+    len += tz_put(buff + len, tz_zigzag((int64_t)(rx - st->rx)));
+
+    st->epoch = epoch;
+    st->tx = tx;
+    st->rx = rx;
+    st->count++;
+
+    return len;
+}
+
+/* fill in an 8 byte index entry */
+void
+tz_index_entry(uint32_t epoch, uint32_t offset, uint8_t *buff)
+{
+    int x;
+
+    for (x=0; x<4; x++) {
+        buff[x] = epoch >> (x * 8);
+        buff[x + 4] = offset >> (x * 8);
+    }
+}
+
+/*
+ * open path for reading, positioned at the block which covers from
+ * (or the start, if there is no index or from is 0). the block offsets
+ * are kept so tz_next() can skip past corrupt records.
+ */
+int
+tz_open(struct tz_reader *r, const char *path, uint32_t from)
+{
+    char ipath[1024];
+    uint8_t e[8];
+    uint32_t epoch;
+    uint32_t offset;
+    uint32_t start = 0;
+    uint32_t last = 0;
+    uint32_t size = 0;
+    FILE *ih;
+    int x;
+
+    memset(r, 0, sizeof(struct tz_reader));
+    r->fh = fopen(path, "r");
+    if (!r->fh)
+        return -1;
+
+    snprintf(ipath, sizeof(ipath), "%s%s", path, TZ_INDEX);
+    if ((ih = fopen(ipath, "r"))) {
+        r->sorted = 1;
+        while (fread(e, sizeof(e), 1, ih) == 1) {
+            for (epoch=0, x=3; x>=0; x--)
+                epoch = (epoch << 8) | e[x];
+            for (offset=0, x=7; x>=4; x--)
+                offset = (offset << 8) | e[x];
+
+            /* the file is only appended to, so anything else is junk */
+            if (r->nblocks && offset <= r->blocks[r->nblocks - 1])
+                break;
+
+            if (r->nblocks == size) {
+                size = size ? size * 2 : 64;
+                r->blocks = realloc(r->blocks, size * sizeof(uint32_t));
+                if (!r->blocks)
+                    err(1, NULL);
+            }
+            r->blocks[r->nblocks++] = offset;
+
+            /*
+             * the last entry <= from will do, as long as the index is in
+             * time order. if the clock went backwards, read it all.
+             */
+            if (epoch < last)
+                r->sorted = 0;
+            last = epoch;
+            if (from && r->sorted && epoch <= from)
+                start = offset;
+        }
+        fclose(ih);
+    }
+
+    if (!r->sorted)
+        start = 0;
+    if (start && fseeko(r->fh, start, SEEK_SET) == -1) {
+        rewind(r->fh);
+        start = 0;
+    }
+    while (r->next < r->nblocks && r->blocks[r->next] < start)
+        r->next++;
+
+    return 0;
+}
+
+/*
+ * decode the next record. returns 1 if there was one, 0 at eof, -1 if
+ * corrupt with no later block to carry on from.
+ */
+int
+tz_next(struct tz_reader *r, uint32_t *epoch, uint64_t *tx, uint64_t *rx)
+{
+    uint64_t v;
+    uint64_t dtx;
+    uint64_t drx;
+    off_t pos;
+    int ret;
+
+    for (;;) {
+        /* at a block start from the index, there has to be a header */
+        if (r->next < r->nblocks && ftello(r->fh) == r->blocks[r->next]) {
+            r->next++;
+            r->open = 0;
+        }
+
+        if ((ret = tz_get(r->fh, &v)) == 0)
+            return 0;
+        if (ret == -1)
+            goto corrupt;
+
+        if (v & 1) {
+            /* block header */
+            if ((v >> 1) != TZ_VERSION || tz_get(r->fh, &v) != 1)
+                goto corrupt;
+            r->epoch = v;
+            r->tx = 0;
+            r->rx = 0;
+            r->count = 0;
+            r->open = 1;
+            continue;
+        }
+
+        if (!r->open || tz_get(r->fh, &dtx) != 1 || tz_get(r->fh, &drx) != 1)
+            goto corrupt;
+
+        /* a record running over a block start is a torn one plus junk */
+        if (r->next < r->nblocks &&
+            ((pos = ftello(r->fh)) == -1 || pos > r->blocks[r->next]))
+            goto corrupt;
+        r->epoch += v >> 1;
+        r->tx += tz_unzigzag(dtx);
+        r->rx += tz_unzigzag(drx);
+        r->count++;
+        *epoch = r->epoch;
+        *tx = r->tx;
+        *rx = r->rx;
+        return 1;
+
+corrupt:
+        /* drop the rest of this block and carry on from the next one */
+        if (r->next >= r->nblocks)
+            return -1;
+        clearerr(r->fh);
+        if (fseeko(r->fh, r->blocks[r->next], SEEK_SET) == -1)
+            return -1;
+        r->open = 0;
+        r->skipped++;
+    }
+}
+
+/*
+ * set st up to carry on the last block of an existing log, so a host
+ * which comes back (after being purged, or a restart) doesnt have to
+ * start a new one. only the last block is read, found via the index.
+ * returns -1 if there is nothing sane to carry on from.
+ */
+int
+tz_resume(struct tz_state *st, const char *path)
+{
+    char ipath[1024];
+    uint8_t e[8];
+    uint32_t epoch;
+    uint32_t offset = 0;
+    uint64_t tx;
+    uint64_t rx;
+    struct tz_reader r;
+    FILE *ih;
+    int ret;
+    int x;
+
+    snprintf(ipath, sizeof(ipath), "%s%s", path, TZ_INDEX);
+    if (!(ih = fopen(ipath, "r")))
+        return -1;
+    ret = fseek(ih, -(long)sizeof(e), SEEK_END) == 0 &&
+          fread(e, sizeof(e), 1, ih) == 1;
+    fclose(ih);
+    if (!ret)
+        return -1;
+    for (x=7; x>=4; x--)
+        offset = (offset << 8) | e[x];
+
+    memset(&r, 0, sizeof(r));
+    if (!(r.fh = fopen(path, "r")))
+        return -1;
+    if (fseeko(r.fh, offset, SEEK_SET) == -1) {
+        tz_close(&r);
+        return -1;
+    }
+    while ((ret = tz_next(&r, &epoch, &tx, &rx)) == 1)
+        ;
+    tz_close(&r);
+
+    /* a torn write at the end means starting afresh */
+    if (ret != 0 || !r.open)
+        return -1;
+
+    st->epoch = r.epoch;
+    st->tx = r.tx;
+    st->rx = r.rx;
+    st->count = r.count;
+    st->open = 1;
+    return 0;
+}
+
+void
+tz_close(struct tz_reader *r)
+{
+    if (r->fh)
+        fclose(r->fh);
+    r->fh = NULL;
+    free(r->blocks);
+    r->blocks = NULL;
+    r->nblocks = 0;
+}
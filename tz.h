@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2012 Joshua Sandbrook.  All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _tz_h
+#define _tz_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * compressed host logs (-z). see tz.c for the format.
+ * log_dir/<ip>.tz holds the records, log_dir/<ip>.tzi the block index.
+ */
+
+#define TZ_SUFFIX      ".tz"
+#define TZ_INDEX       "i"      /* appended to the .tz path */
+#define TZ_BLOCK       256      /* records per block */
+#define TZ_VERSION     1
+#define TZ_MAX_RECORD  32       /* header + record, worst case (6 + 5 + 10 + 10) */
+
+/* encoder state for one log file, ie per host */
+struct tz_state {
+    uint64_t tx;                /* tx/rx of the last record */
+    uint64_t rx;
+    uint32_t epoch;             /* epoch of the last record */
+    uint16_t count;             /* records in the current block */
+    uint16_t open;              /* nonzero if a block is open */
+};
+
+/* streaming decoder */
+struct tz_reader {
+    FILE     *fh;
+    uint32_t  epoch;
+    uint64_t  tx;
+    uint64_t  rx;
+    uint16_t  count;            /* records since the block header */
+    int       open;             /* seen a block header */
+    uint32_t *blocks;           /* block offsets from the index */
+    uint32_t  nblocks;
+    uint32_t  next;             /* next block start after the read position */
+    int       sorted;           /* have an index, in time order */
+    uint32_t  skipped;          /* corrupt stretches skipped over */
+};
+
+extern int   tz_needs_block(struct tz_state *st, uint32_t epoch);
+extern int   tz_encode(struct tz_state *st, uint32_t epoch, uint64_t tx,
+                       uint64_t rx, uint8_t *buff, size_t buff_size);
+extern void  tz_index_entry(uint32_t epoch, uint32_t offset, uint8_t *buff);
+extern int   tz_resume(struct tz_state *st, const char *path);
+extern int   tz_open(struct tz_reader *r, const char *path, uint32_t from);
+extern int   tz_next(struct tz_reader *r, uint32_t *epoch, uint64_t *tx,
+                     uint64_t *rx);
+extern void  tz_close(struct tz_reader *r);
+
+#endif